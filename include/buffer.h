@@ -2,6 +2,9 @@
 #define BUFFER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+
+#include "rope.h"
 
 
 typedef struct buffer
@@ -10,11 +13,11 @@ typedef struct buffer
     char *name;
     // File location
     char *location;
-    // Total line count
+    // Total line count (only the lines indexed so far while loading)
     int line_count;
-    // Line array
-    char **lines;
-    // Y locations of the every lines on screen (only valid if visible)
+    // Lines
+    rope_t lines;
+    // Y locations of the lines on screen, relative to ys (only valid if visible)
     int *line_screen_pos;
     // X and Y location of cursor (X in utf8 characters)
     int x, y;
@@ -24,9 +27,15 @@ typedef struct buffer
     int linenr_width;
     // True iff content has been modified
     bool modified;
-    // Number of screen lines at bottom belonging to a line too long to be displayed (only valid if visible)
-    // (OLL = overly long line)
-    int oll_unused_lines;
+    // File content (memory mapped or allocated) unmodified lines point into
+    char *content;
+    size_t content_size;
+    // Set iff the content is memory mapped
+    struct content_mapping *mapping;
+    // Line that has been allocated with room to spare for editing (-1 if none)
+    int grown_line;
+    // Indexes the file in the background (NULL if it has been loaded completely)
+    struct buffer_loader *loader;
 } buffer_t;
 
 
@@ -47,6 +56,36 @@ bool buffer_load(buffer_t *buf, const char *source);
 bool buffer_write(buffer_t *buf, const char *target);
 void buffer_destroy(buffer_t *buf);
 
+line_t *buffer_line(buffer_t *buf, int line);
+// Returns the first position in the line that has at least "chars" characters
+// or "column" screen columns in front of it (or the end of the line)
+line_pos_t buffer_line_seek(buffer_t *buf, line_t *line, int chars, int column);
+
+// Updates the line number width and the screen rows of all lines; has to be
+// called whenever the line count or the terminal width changes
+void buffer_update_geometry(buffer_t *buf);
+// Has to be called for every buffer whenever the terminal size changes
+void buffer_update_screen_size(buffer_t *buf);
+
+// Appends the lines indexed in the background so far; returns true iff there
+// were any (or loading has finished)
+bool buffer_update_loading(buffer_t *buf);
+// Blocks until at least "count" lines have been indexed (or the whole file)
+void buffer_await_lines(buffer_t *buf, int count);
+// Splits the text into lines the way loading a file does and discards them;
+// returns the line count (for benchmarking)
+int buffer_split_lines(const char *text, size_t len);
+// Percentage of the file indexed so far
+int buffer_load_progress(buffer_t *buf);
+
+// Returns true (once) if the file has been truncated by someone else while
+// it was mapped; the lost part of the content then reads as zero bytes and the
+// buffer is marked as modified
+bool buffer_check_truncation(buffer_t *buf);
+
+// Releases the spare room of the last edited line if the cursor has left it
+void buffer_compact_line(buffer_t *buf);
+
 void buffer_insert(buffer_t *buf, const char *string);
 void buffer_delete(buffer_t *buf, int char_count);
 
@@ -22,6 +22,8 @@ void update_active_buffer(void);
 void reposition_cursor(bool update_desire);
 void ensure_cursor_visibility(void);
 void scroll(int lines);
+// Scrolls by screen rows instead of lines
+void scroll_rows(int rows);
 
 void write_string(const char *s);
 void delete_chars(int count);
@@ -9,7 +9,9 @@ typedef enum event_type
     EVENT_NORMAL_KEY_SEQ,
     EVENT_INSERT_KEY,
     EVENT_MBUTTON_DOWN,
-    EVENT_MBUTTON_UP
+    EVENT_MBUTTON_UP,
+    // The terminal size has changed (term_width and term_height are up to date)
+    EVENT_TERM_RESIZE
 } event_type_t;
 
 typedef struct event
@@ -45,4 +47,13 @@ typedef struct event_handler
 bool trigger_event(event_t event);
 void register_event_handler(event_t event, bool (*handler)(const event_t *event, void *info), void *info);
 
+// Normal mode key sequences can be matched key by key: Returns the node reached
+// by appending "key" to the sequence ending at "node" (0 being the empty
+// sequence), or -1 if no key sequence handler begins that way
+int key_seq_step(int node, int key);
+// True iff there are key sequence handlers for longer sequences than "node"
+bool key_seq_is_prefix(int node);
+// Calls the handler for the sequence ending at "node" (if there is one)
+bool trigger_key_seq(int node, event_t event);
+
 #endif
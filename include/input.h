@@ -1,10 +1,33 @@
 #ifndef INPUT_H
 #define INPUT_H
 
-void init_mouse_input_regex(void);
+#include <stdbool.h>
+#include <stddef.h>
+
+
+void input_init(void);
 
 int input_read(void);
+// Returns true iff input is available within "timeout" milliseconds (forever
+// if negative); returns false early after something else has happened (a
+// watched file descriptor or timer has fired, or input_notify() was called)
+bool input_wait(int timeout);
+// Returns the text pasted last (when input_read() has returned KEY_PASTE)
+const char *input_pasted_text(void);
 void sim_input(int val);
+// Appends "count" values at once
+void sim_input_array(const int *vals, size_t count);
+
+// Calls "handler" from input_wait() whenever "fd" becomes readable
+void input_watch_fd(int fd, void (*handler)(void *info), void *info);
+void input_unwatch_fd(int fd);
+// Calls "handler" (if not NULL) from input_wait() every "interval"
+// milliseconds; returns the timer (-1 on error)
+int input_add_timer(int interval, void (*handler)(void *info), void *info);
+void input_remove_timer(int timer);
+// Interrupts input_wait(), so the main loop shows what has been done in the
+// background; may be called from any thread
+void input_notify(void);
 
 // Note: This function takes control of "sequence".
 void add_input_escape_sequence(char *sequence, int keycode);
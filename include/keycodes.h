@@ -28,6 +28,9 @@
 #define KEY_F11 0xe01b
 #define KEY_F12 0xe01c
 
+// Text has been pasted (see input_pasted_text())
+#define KEY_PASTE 0xe020
+
 #define KEY_BACKSPACE 127
 
 #define KEY_NSHIFT  0x0020
@@ -0,0 +1,126 @@
+#ifndef ROPE_H
+#define ROPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "slab.h"
+
+
+// Position of a character boundary within a line
+typedef struct line_pos
+{
+    // Characters and screen columns in front of it
+    int chars, column;
+    // Byte offset
+    size_t offset;
+} line_pos_t;
+
+// Positions spread out over a long line, in ascending order (so it does not
+// have to be walked from its start to find a character or column)
+typedef struct line_checkpoints
+{
+    // Allocated size of this structure
+    size_t size;
+    int count;
+    line_pos_t pos[];
+} line_checkpoints_t;
+
+
+typedef struct line
+{
+    // Content (NUL-terminated, unless it is not owned by the line)
+    char *text;
+    // Length of the content in bytes (excluding the NUL)
+    size_t len;
+    // Allocated size of the content (including the NUL); 0 if the content is
+    // not owned by the line (but e.g. points into the loaded file)
+    size_t capacity;
+    // Length in UTF-8 characters
+    int chars;
+    // Width on screen in columns (tabs expanded)
+    int width;
+    // True iff the line contains tabs (so its width cannot be updated
+    // incrementally)
+    bool tabs;
+    // True iff the content is known to be valid UTF-8 (so it can be decoded
+    // without looking out for broken characters)
+    bool valid_utf8;
+    // Checkpoints (owned by the rope, NULL if there are none)
+    line_checkpoints_t *checkpoints;
+} line_t;
+
+
+// Balanced (treap) tree of lines, ordered by line number
+typedef struct rope_node
+{
+    struct rope_node *left, *right;
+    uint32_t priority;
+
+    // Number of lines in this subtree
+    int lines;
+    // Number of bytes in this subtree (every line including its newline)
+    size_t bytes;
+    // Number of screen rows the lines in this subtree take up, and the number
+    // of rows of this node's line alone
+    int rows, line_rows;
+
+    line_t line;
+} rope_node_t;
+
+typedef struct rope
+{
+    rope_node_t *root;
+
+    // Columns in front of every line and columns per screen row, which
+    // determine how many rows a line takes up (rows are not counted if the
+    // latter is 0)
+    int row_prefix, row_width;
+
+    // Nodes and line contents are allocated from here, so the whole rope can
+    // be freed at once
+    slab_t nodes;
+    text_heap_t text;
+} rope_t;
+
+
+void rope_init(rope_t *rope);
+void rope_clear(rope_t *rope);
+
+int rope_line_count(const rope_t *rope);
+line_t *rope_line(rope_t *rope, int index);
+// Has to be called after the length or width of a line has changed
+void rope_update(rope_t *rope, int index);
+
+// Inserts the given lines in front of line "index". The rope takes control of
+// the lines' content, which has to be allocated with rope_resize_line() (or
+// not be owned by the lines).
+void rope_insert(rope_t *rope, int index, const line_t *lines, int count);
+void rope_remove(rope_t *rope, int index, int count);
+// Moves all lines of "tail" to the end of "rope"
+void rope_append(rope_t *rope, rope_t *tail);
+
+// Gives the line its own content with room for at least "capacity" bytes
+// (which may also shrink it), keeping as much of its current content as fits
+void rope_resize_line(rope_t *rope, line_t *line, size_t capacity);
+
+// Makes room for at least "count" checkpoints in the line, keeping the
+// existing ones; a count of 0 frees them
+void rope_resize_checkpoints(rope_t *rope, line_t *line, int count);
+
+size_t rope_byte_offset(const rope_t *rope, int index);
+int rope_line_at_byte(const rope_t *rope, size_t offset);
+
+// Recounts the rows of all lines if the geometry has changed
+void rope_set_geometry(rope_t *rope, int prefix, int width);
+int rope_row_count(const rope_t *rope);
+// Returns the number of rows in front of line "index"
+int rope_row_offset(const rope_t *rope, int index);
+// Returns the line containing the given row (or -1 if there is none); stores
+// the line's first row in *first_row
+int rope_line_at_row(const rope_t *rope, int row, int *first_row);
+
+void rope_foreach(rope_t *rope, void (*func)(line_t *line, void *info), void *info);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+
+#define SLAB_CHUNK_SIZE (64 << 10)
+
+// Allocates objects of a fixed size from large chunks, which are only returned
+// to the system all at once
+typedef struct slab
+{
+    size_t object_size;
+
+    // Chunks (each one beginning with a pointer to the next one)
+    void *chunks;
+    // Freed objects (each one beginning with a pointer to the next one)
+    void *free_list;
+    // Part of the newest chunk that has never been used
+    char *unused, *unused_end;
+
+    size_t chunk_count, used_objects;
+} slab_t;
+
+
+void slab_init(slab_t *slab, size_t object_size);
+void *slab_alloc(slab_t *slab);
+void slab_free(slab_t *slab, void *object);
+// Frees all objects at once
+void slab_release(slab_t *slab);
+// Moves all objects of "src" to "dst" (which have to have the same size)
+void slab_adopt(slab_t *dst, slab_t *src);
+
+
+// Size classes of text heaps: 16, 32, ..., 4096 bytes
+#define TEXT_HEAP_MIN_SHIFT 4
+#define TEXT_HEAP_CLASSES 9
+
+// Allocator for line contents with one slab per power-of-two size class;
+// larger allocations are made separately, but kept in a list so they can be
+// released at once as well
+typedef struct text_heap
+{
+    slab_t classes[TEXT_HEAP_CLASSES];
+
+    struct large_text *large;
+    size_t large_count, large_bytes;
+} text_heap_t;
+
+
+void text_heap_init(text_heap_t *heap);
+// Returns room for at least *size bytes and stores its actual size in *size;
+// "text" (NULL for a new allocation) has to have been allocated with
+// old_size bytes
+char *text_heap_realloc(text_heap_t *heap, char *text, size_t old_size, size_t *size);
+void text_heap_free(text_heap_t *heap, char *text, size_t size);
+void text_heap_release(text_heap_t *heap);
+void text_heap_adopt(text_heap_t *dst, text_heap_t *src);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef TERM_H
 #define TERM_H
 
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -28,7 +29,16 @@ typedef struct color
 } color_t;
 
 
+// Output statistics, to check that frames do not take more than one write
+typedef struct term_stats
+{
+    unsigned long frames, writes, bytes;
+    int max_frame_writes;
+} term_stats_t;
+
+
 extern int term_width, term_height;
+extern term_stats_t term_stats;
 
 #define buffer_width  (term_width)
 #define buffer_height (term_height - 3)
@@ -37,8 +47,17 @@ extern int term_width, term_height;
 void term_init(void);
 void term_release(void);
 
+// Everything is drawn onto a virtual screen first; term_flush() ends the frame
+// and brings the terminal up to date by printing what has changed since the
+// last one (with a single write)
 void print(const char *s);
-void print_flushed(const char *s);
+void term_putchar(int c);
+int term_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+int term_vprintf(const char *format, va_list va);
+void term_flush(void);
+// Tells the terminal that the rows "top" to "bottom" have moved up by the given
+// number of lines (down if negative), so it can scroll them itself
+void term_scroll(int top, int bottom, int lines);
 
 void term_clear(void);
 void term_underline(bool ul);
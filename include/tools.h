@@ -1,6 +1,29 @@
 #ifndef TOOLS_H
 #define TOOLS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 int get_decimal_length(int number);
+// Milliseconds on a monotonic clock
+int64_t get_time_ms(void);
+
+// Appends the durations of the startup phases to the given file (for
+// --startuptime)
+bool startup_report_open(const char *path);
+// Records that a startup phase has ended (if a report is being written)
+void startup_phase(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void startup_report_close(void);
+
+// Stores pointers to the first (at most) max newlines in str[0..len) in found
+// and returns how many have been found
+size_t find_newlines(const char *str, size_t len, const char **found, size_t max);
+// Number of find_newlines() implementations this machine supports; the last
+// one is the fastest and used by default
+int find_newlines_implementations(void);
+// Makes find_newlines() use the given implementation (for comparison) and
+// returns its name
+const char *find_newlines_select(int index);
 
 #endif
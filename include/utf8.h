@@ -3,11 +3,41 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 size_t utf8_strlen(const char *str);
+size_t utf8_strnlen(const char *str, size_t n);
 size_t utf8_strlen_vis(const char *str);
-bool utf8_is_dbc(const char *str);
+size_t utf8_strnlen_vis(const char *str, size_t n);
+// Malformed text is split into characters like this everywhere (when
+// measuring, moving through a line and drawing it): every byte but a
+// continuation byte starts a character, and so does a continuation byte
+// directly behind an ASCII character (or at the start).  All other
+// continuation bytes belong to the character in front of them.  A character
+// that is not a complete, well-formed sequence takes one column.
+
+// Number of columns (0, 1 or 2) the character takes on the screen, looking at
+// no more than n bytes
+int utf8_width(const char *str, size_t n);
+// Same for characters known to be valid UTF-8 (not checked)
+int utf8_width_valid(const char *str);
+int utf8_codepoint_width(uint32_t codepoint) __attribute__((const));
 int utf8_mbclen(char start_chr) __attribute__((pure));
+// Number of bytes (at most n) that belong to the character starting at str
+size_t utf8_char_size(const char *str, size_t n) __attribute__((pure));
 int utf8_byte_offset(const char *str, int char_count);
 
+// Returns true iff the first n bytes of str are valid UTF-8 (no overlong
+// forms, surrogates or truncated characters)
+bool utf8_validate(const char *str, size_t n);
+
+// Counts the characters in the first n bytes of str and the columns they take
+// (control characters, including NUL and tab, take one column, too)
+void utf8_measure(const char *str, size_t n, size_t *chars, size_t *width);
+
+// Name of the (vectorized) implementation used for counting characters
+const char *utf8_implementation(void);
+// Makes the scalar implementation be used instead (for comparison)
+void utf8_force_scalar(bool scalar);
+
 #endif
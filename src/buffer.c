@@ -1,12 +1,22 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "buffer.h"
+#include "config.h"
 #include "editor.h"
+#include "input.h"
 #include "term.h"
 #include "tools.h"
 #include "utf8.h"
@@ -16,6 +26,428 @@ buffer_list_t *buffer_list = NULL;
 buffer_t *active_buffer = NULL;
 
 
+// Zero bytes behind the file content, so that decoding a character that has
+// been cut off at EOF will not read beyond the mapping
+#define CONTENT_PADDING 4
+
+// Files larger than this are split into lines by multiple threads
+#define PARALLEL_SPLIT_MIN_SIZE (16 << 20)
+#define MAX_SPLIT_THREADS 8
+
+// Files larger than this are indexed in the background (in segments), so they
+// can be displayed before they have been split completely
+#define BACKGROUND_LOAD_MIN_SIZE (64 << 20)
+#define LOAD_FIRST_SEGMENT_SIZE (256 << 10)
+#define LOAD_SEGMENT_SIZE (64 << 20)
+
+
+// Long lines keep a checkpoint about every LINE_CHECKPOINT_INTERVAL bytes
+#define LINE_CHECKPOINT_INTERVAL 1024
+#define LINE_CHECKPOINT_MIN_LEN (4 * LINE_CHECKPOINT_INTERVAL)
+
+
+// Advances *pos over the next n bytes of the text (which have to end on a
+// character boundary); sets *tabs if there are any tabs among them
+static void advance_pos(const char *text, size_t n, line_pos_t *pos, bool *tabs)
+{
+    size_t end = pos->offset + n;
+
+    while (pos->offset < end)
+    {
+        // Everything but tabs has a fixed width
+        const char *tab = memchr(&text[pos->offset], '\t', end - pos->offset);
+        size_t run = (tab != NULL) ? (size_t)(tab - &text[pos->offset]) : (end - pos->offset);
+
+        size_t chars, width;
+        utf8_measure(&text[pos->offset], run, &chars, &width);
+
+        pos->chars += chars;
+        pos->column += width;
+        pos->offset += run;
+
+        if (tab != NULL)
+        {
+            pos->column += tabstop_width - pos->column % tabstop_width;
+            pos->chars++;
+            pos->offset++;
+            *tabs = true;
+        }
+    }
+}
+
+
+// Recalculates the cached length and width of a line from scratch
+static void update_line_info(line_t *line)
+{
+    line_pos_t end = { 0 };
+
+    line->tabs = false;
+    advance_pos(line->text, line->len, &end, &line->tabs);
+
+    line->chars = end.chars;
+    line->width = end.column;
+}
+
+
+// Same for an edited line of the buffer, whose checkpoints become invalid
+static void recalc_line(buffer_t *buf, line_t *line)
+{
+    rope_resize_checkpoints(&buf->lines, line, 0);
+    update_line_info(line);
+    line->valid_utf8 = utf8_validate(line->text, line->len);
+}
+
+
+// Adds checkpoints in front of checkpoint "index" (or the end of the line) if
+// the gap between it and the previous one has grown too large
+static void fill_checkpoint_gap(buffer_t *buf, line_t *line, int index)
+{
+    line_checkpoints_t *cps = line->checkpoints;
+
+    line_pos_t pos = index ? cps->pos[index - 1] : (line_pos_t){ 0 };
+    size_t end = (index < cps->count) ? cps->pos[index].offset : line->len;
+
+    if (end - pos.offset <= 2 * LINE_CHECKPOINT_INTERVAL)
+        return;
+
+    // Make room for as many as might be needed, then close the rest again
+    int room = (end - pos.offset) / LINE_CHECKPOINT_INTERVAL;
+    rope_resize_checkpoints(&buf->lines, line, cps->count + room + cps->count / 8);
+    cps = line->checkpoints;
+
+    memmove(&cps->pos[index + room], &cps->pos[index], (cps->count - index) * sizeof(cps->pos[0]));
+
+    int added = 0;
+    bool tabs = false;
+
+    while (end - pos.offset > 2 * LINE_CHECKPOINT_INTERVAL)
+    {
+        // Continuation bytes only belong to a character if they follow a
+        // non-ASCII byte
+        size_t next = pos.offset + LINE_CHECKPOINT_INTERVAL;
+        while ((next < end) && ((line->text[next] & 0xc0) == 0x80) && (line->text[next - 1] & 0x80))
+            next++;
+
+        if (next >= end)
+            break;
+
+        advance_pos(line->text, next - pos.offset, &pos, &tabs);
+        cps->pos[index + added++] = pos;
+    }
+
+    memmove(&cps->pos[index + added], &cps->pos[index + room], (cps->count - index) * sizeof(cps->pos[0]));
+    cps->count += added;
+}
+
+
+// Has to be called after "removed" bytes at offset "ofs" of a line have been
+// replaced by "inserted" ones, which changed the length of the line by the
+// given number of characters and columns (for lines with tabs, the column
+// difference would not be the same throughout the rest of the line, so
+// recalc_line() has to be used instead)
+static void move_checkpoints(buffer_t *buf, line_t *line, size_t ofs, size_t removed, size_t inserted, int chars, int columns)
+{
+    line_checkpoints_t *cps = line->checkpoints;
+    if (cps == NULL)
+        return;
+
+    // Checkpoints up to the change stay, the ones within it are dropped
+    int first = 0;
+    while ((first < cps->count) && (cps->pos[first].offset <= ofs))
+        first++;
+
+    int behind = first;
+    while ((behind < cps->count) && (cps->pos[behind].offset < ofs + removed))
+        behind++;
+
+    memmove(&cps->pos[first], &cps->pos[behind], (cps->count - behind) * sizeof(cps->pos[0]));
+    cps->count -= behind - first;
+
+    for (int i = first; i < cps->count; i++)
+    {
+        cps->pos[i].chars += chars;
+        cps->pos[i].column += columns;
+        cps->pos[i].offset = cps->pos[i].offset + inserted - removed;
+    }
+
+    fill_checkpoint_gap(buf, line, first);
+}
+
+
+// Walks through the line from "pos" to the first position that has at least
+// "chars" characters or "column" columns in front of it
+static line_pos_t walk_line(const line_t *line, line_pos_t pos, int chars, int column)
+{
+    const char *text = line->text;
+
+    if (line->valid_utf8)
+    {
+        while ((pos.offset < line->len) && (pos.chars < chars) && (pos.column < column))
+        {
+            if (text[pos.offset] == '\t')
+                pos.column += tabstop_width - pos.column % tabstop_width;
+            else
+                pos.column += utf8_width_valid(&text[pos.offset]);
+
+            pos.offset += utf8_mbclen(text[pos.offset]);
+            pos.chars++;
+        }
+
+        return pos;
+    }
+
+    while ((pos.offset < line->len) && (pos.chars < chars) && (pos.column < column))
+    {
+        if (text[pos.offset] == '\t')
+            pos.column += tabstop_width - pos.column % tabstop_width;
+        else
+            pos.column += utf8_width(&text[pos.offset], line->len - pos.offset);
+
+        pos.offset += utf8_char_size(&text[pos.offset], line->len - pos.offset);
+
+        pos.chars++;
+    }
+
+    return pos;
+}
+
+
+line_pos_t buffer_line_seek(buffer_t *buf, line_t *line, int chars, int column)
+{
+    line_pos_t start = { 0 };
+
+    if (line->len >= LINE_CHECKPOINT_MIN_LEN)
+    {
+        if (line->checkpoints == NULL)
+        {
+            rope_resize_checkpoints(&buf->lines, line, line->len / LINE_CHECKPOINT_INTERVAL);
+            fill_checkpoint_gap(buf, line, 0);
+        }
+
+        // Find the last checkpoint in front of the position
+        const line_checkpoints_t *cps = line->checkpoints;
+        int low = 0, high = cps->count;
+
+        while (low < high)
+        {
+            int mid = (low + high) / 2;
+
+            if ((cps->pos[mid].chars <= chars) && (cps->pos[mid].column < column))
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        if (low)
+            start = cps->pos[low - 1];
+    }
+
+    return walk_line(line, start, chars, column);
+}
+
+
+// Gives the line its own copy of its content if it still points into the file
+static void materialize_line(buffer_t *buf, line_t *line)
+{
+    if (!line->capacity)
+        rope_resize_line(&buf->lines, line, line->len + 1);
+}
+
+
+// Every buffer has at least one line
+static void add_empty_line(buffer_t *buf)
+{
+    rope_insert(&buf->lines, 0, &(line_t){ .text = (char *)"", .len = 0, .capacity = 0, .valid_utf8 = true }, 1);
+    buf->line_count = 1;
+}
+
+
+// Mapped file contents, so that the SIGBUS handler can find them. The handler
+// may run in any thread at any time, so entries are only ever reused, never
+// freed.
+static struct content_mapping
+{
+    struct content_mapping *next;
+    // NULL if unused
+    _Atomic(char *) start;
+    size_t size;
+    atomic_bool truncated;
+} *_Atomic content_mappings;
+
+// sysconf() is not async-signal-safe, so this is queried in advance
+static uintptr_t page_size;
+
+
+// Accessing a mapping beyond the end of its file (because someone else has
+// truncated it) raises SIGBUS; replace the missing part by zero pages, so the
+// access can be retried, and let the editor report it
+static void handle_sigbus(int sig, siginfo_t *info, void *context)
+{
+    (void)context;
+
+    char *addr = info->si_addr;
+
+    for (struct content_mapping *cm = content_mappings; cm != NULL; cm = cm->next)
+    {
+        char *start = cm->start;
+
+        if ((start == NULL) || (addr < start) || (addr >= start + cm->size))
+            continue;
+
+        char *page = (char *)((uintptr_t)addr & ~(page_size - 1));
+
+        if (mmap(page, start + cm->size - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+        {
+            atomic_store(&cm->truncated, true);
+            return;
+        }
+
+        break;
+    }
+
+    // Not ours, so let it crash
+    signal(sig, SIG_DFL);
+}
+
+
+static struct content_mapping *register_mapping(char *start, size_t size)
+{
+    static bool handler_installed;
+
+    if (!handler_installed)
+    {
+        page_size = sysconf(_SC_PAGESIZE);
+
+        struct sigaction sa = { .sa_sigaction = handle_sigbus, .sa_flags = SA_SIGINFO | SA_RESTART };
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, NULL);
+
+        handler_installed = true;
+    }
+
+    struct content_mapping *cm;
+    for (cm = content_mappings; (cm != NULL) && (cm->start != NULL); cm = cm->next);
+
+    if (cm == NULL)
+    {
+        cm = malloc(sizeof(*cm));
+        cm->next = content_mappings;
+        cm->start = NULL;
+        content_mappings = cm;
+    }
+
+    cm->size = size;
+    atomic_store(&cm->truncated, false);
+    atomic_store(&cm->start, start);
+
+    return cm;
+}
+
+
+bool buffer_check_truncation(buffer_t *buf)
+{
+    if ((buf->mapping == NULL) || !atomic_exchange(&buf->mapping->truncated, false))
+        return false;
+
+    buf->modified = true;
+    return true;
+}
+
+
+static void release_content(buffer_t *buf)
+{
+    if (buf->mapping != NULL)
+    {
+        atomic_store(&buf->mapping->start, NULL);
+        munmap(buf->content, buf->content_size + CONTENT_PADDING);
+    }
+    else
+        free(buf->content);
+
+    buf->content = NULL;
+    buf->content_size = 0;
+    buf->mapping = NULL;
+}
+
+
+// Maps the whole file into memory (or reads it, if that is not possible), with
+// CONTENT_PADDING zero bytes behind it. Other processes may still truncate the
+// file afterwards, see handle_sigbus().
+static bool load_content(buffer_t *buf, const char *source)
+{
+    int fd = open(source, O_RDONLY);
+
+    if (fd < 0)
+        return false;
+
+
+    struct stat st;
+    if (fstat(fd, &st) || S_ISDIR(st.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size)
+    {
+        // Reserve zeroed memory for the padding first, then map the file over it
+        size_t fsz = st.st_size;
+        char *content = mmap(NULL, fsz + CONTENT_PADDING, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if ((content != MAP_FAILED) && (mmap(content, fsz, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED))
+        {
+            close(fd);
+
+            buf->content = content;
+            buf->content_size = fsz;
+            buf->mapping = register_mapping(content, fsz);
+
+            return true;
+        }
+
+        if (content != MAP_FAILED)
+            munmap(content, fsz + CONTENT_PADDING);
+    }
+
+
+    // Not mappable (e.g. a pipe), so read it
+    size_t size = 0, capacity = 4096;
+    char *content = malloc(capacity + CONTENT_PADDING);
+
+    ssize_t ret;
+    while ((ret = read(fd, &content[size], capacity - size)) > 0)
+    {
+        size += ret;
+        if (size == capacity)
+            content = realloc(content, (capacity *= 2) + CONTENT_PADDING);
+    }
+
+    close(fd);
+
+    if (ret < 0)
+    {
+        free(content);
+        return false;
+    }
+
+    memset(&content[size], 0, CONTENT_PADDING);
+
+    buf->content = content;
+    buf->content_size = size;
+    buf->mapping = NULL;
+
+    return true;
+}
+
+
+// Columns taken up by the line number in front of every line (with a space on
+// either side)
+static int linenr_columns(int line_count)
+{
+    return 1 + get_decimal_length(line_count) + 1;
+}
+
+
 static void update_buffer_name(buffer_t *buf)
 {
     free(buf->name);
@@ -49,14 +481,17 @@ buffer_t *new_buffer(void)
     buf->x = buf->y = buf->ys = 0;
     buf->modified = false;
 
-    buf->line_count = 1;
-    buf->linenr_width = 1;
+    buf->content = NULL;
+    buf->content_size = 0;
+    buf->mapping = NULL;
+    buf->loader = NULL;
 
-    buf->lines = malloc(sizeof(*buf->lines));
-    buf->line_screen_pos = malloc(sizeof(*buf->line_screen_pos));
+    rope_init(&buf->lines);
+    add_empty_line(buf);
+    buf->grown_line = -1;
 
-    buf->lines[0] = malloc(1);
-    buf->lines[0][0] = 0;
+    buf->line_screen_pos = NULL;
+    buffer_update_screen_size(buf);
 
     buf->name = strdup("[unnamed]");
 
@@ -67,72 +502,501 @@ buffer_t *new_buffer(void)
 }
 
 
-bool buffer_load(buffer_t *buf, const char *source)
+typedef struct split_job
 {
-    FILE *fp = fopen(source, "r");
+    // Part of the file (beginning at a line start and ending behind a newline
+    // or at EOF)
+    const char *start, *end;
 
-    if (fp == NULL)
-        return false;
+    line_t *lines;
+    int count, capacity;
 
+    pthread_t thread;
+    bool threaded;
+} split_job_t;
 
-    fseek(fp, 0, SEEK_END);
-    size_t fsz = ftell(fp);
-    rewind(fp);
 
-    char *content = malloc(fsz + 1);
-    fread(content, 1, fsz, fp);
-    content[fsz] = 0;
+// Lines split off from the file, not yet inserted into the rope
+typedef struct line_batch
+{
+    struct line_batch *next;
 
-    fclose(fp);
+    line_t *lines;
+    int count;
+} line_batch_t;
 
 
-    free(buf->location);
-    for (int i = 0; i < buf->line_count; i++)
-        free(buf->lines[i]);
-    free(buf->lines);
-    free(buf->line_screen_pos);
+// State of a file that is being split into lines in the background
+struct buffer_loader
+{
+    pthread_t thread;
+
+    const char *content, *end;
+    // Screen columns when loading started
+    int row_width;
+    // Number of lines the line numbers have room for while loading (only
+    // used by the main thread)
+    int reserved_lines;
+
+    // Protects everything below
+    pthread_mutex_t lock;
+    // Signalled whenever new lines are pending or the loader has finished
+    pthread_cond_t indexed;
+
+    // Lines indexed but not yet taken over by the buffer
+    rope_t pending;
+    // Number of lines the whole file is expected to have
+    int expected_lines;
+    // End of the part of the file indexed so far
+    const char *indexed_end;
+    bool done, cancel;
+};
+
+
+// "valid" may be set if the line is known to be valid UTF-8 already
+static void split_add_line(split_job_t *job, const char *start, const char *newline, bool valid)
+{
+    const char *end = newline ? newline : job->end;
 
+    if (newline && (newline != start) && (newline[-1] == '\r'))
+        end--;
 
-    buf->location = strdup(source);
+    if (job->count >= job->capacity)
+        job->lines = realloc(job->lines, (job->capacity *= 2) * sizeof(*job->lines));
 
-    buf->x = buf->y = buf->ys = 0;
-    buf->modified = false;
+    // Unmodified lines point directly into the file content
+    line_t *line = &job->lines[job->count++];
+    *line = (line_t){ .text = (char *)start, .len = end - start, .capacity = 0 };
+    update_line_info(line);
+    line->valid_utf8 = valid || utf8_validate(line->text, line->len);
+}
 
-    buf->line_count = 1;
-    for (int i = 0; content[i]; i++)
-        if ((content[i] == '\n') && content[i + 1]) // Don't count an empty line at EOF
-            buf->line_count++;
 
-    buf->linenr_width = get_decimal_length(buf->line_count);
+static void *split_lines(void *arg)
+{
+    split_job_t *job = arg;
+    const char *found[256];
+
+    const char *line_start = job->start;
+    while (line_start < job->end)
+    {
+        size_t count = find_newlines(line_start, job->end - line_start, found, sizeof(found) / sizeof(found[0]));
+
+        if (!count)
+        {
+            // Last line without a trailing newline
+            split_add_line(job, line_start, NULL, false);
+            break;
+        }
+
+        // Validate all of these lines at once, and only look at them one by
+        // one if there is something wrong
+        bool valid = utf8_validate(line_start, found[count - 1] - line_start);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            split_add_line(job, line_start, found[i], valid);
+            line_start = found[i] + 1;
+        }
+    }
+
+    return NULL;
+}
 
-    buf->lines = malloc(buf->line_count * sizeof(*buf->lines));
-    buf->line_screen_pos = malloc(buf->line_count * sizeof(*buf->line_screen_pos));
 
-    char *content_pos = content;
-    for (int i = 0; content_pos; i++)
+// Splits the given part of the file (beginning at a line start) into lines,
+// using multiple threads if it is large. Returns the lines in file order.
+static line_batch_t *split_content(const char *content, const char *end)
+{
+    size_t size = end - content;
+
+    int thread_count = 1;
+    if (size >= PARALLEL_SPLIT_MIN_SIZE)
     {
-        char *newline = strchr(content_pos, '\n');
-        if (newline)
-            *newline = 0;
-        else if (!*content_pos) // Ignore empty line at EOF
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (cpus < 1) ? 1 : (cpus > MAX_SPLIT_THREADS) ? MAX_SPLIT_THREADS : cpus;
+    }
+
+    // Every thread gets a part of the file beginning at a line start
+    split_job_t jobs[MAX_SPLIT_THREADS];
+    const char *chunk_start = content;
+
+    for (int t = 0; t < thread_count; t++)
+    {
+        const char *chunk_end = end;
+
+        if (t < thread_count - 1)
+        {
+            chunk_end = content + size / thread_count * (t + 1);
+            if (chunk_end < chunk_start)
+                chunk_end = chunk_start;
+
+            const char *newline = memchr(chunk_end, '\n', end - chunk_end);
+            chunk_end = newline ? (newline + 1) : end;
+        }
+
+        jobs[t] = (split_job_t){ .start = chunk_start, .end = chunk_end, .count = 0 };
+        jobs[t].capacity = (chunk_end - chunk_start) / 64 + 16;
+        jobs[t].lines = malloc(jobs[t].capacity * sizeof(*jobs[t].lines));
+
+        chunk_start = chunk_end;
+    }
+
+    for (int t = 1; t < thread_count; t++)
+        jobs[t].threaded = !pthread_create(&jobs[t].thread, NULL, split_lines, &jobs[t]);
+
+    split_lines(&jobs[0]);
+
+    line_batch_t *batches = NULL, **tail = &batches;
+
+    for (int t = 0; t < thread_count; t++)
+    {
+        if (t)
+        {
+            if (jobs[t].threaded)
+                pthread_join(jobs[t].thread, NULL);
+            else
+                split_lines(&jobs[t]);
+        }
+
+        if (!jobs[t].count)
+        {
+            free(jobs[t].lines);
+            continue;
+        }
+
+        *tail = malloc(sizeof(**tail));
+        **tail = (line_batch_t){ .next = NULL, .lines = jobs[t].lines, .count = jobs[t].count };
+        tail = &(*tail)->next;
+    }
+
+    return batches;
+}
+
+
+int buffer_split_lines(const char *text, size_t len)
+{
+    int count = 0;
+
+    for (line_batch_t *batch = split_content(text, text + len), *next; batch != NULL; batch = next)
+    {
+        next = batch->next;
+        count += batch->count;
+
+        free(batch->lines);
+        free(batch);
+    }
+
+    return count;
+}
+
+
+// Appends the lines to the rope and frees the batches; returns the number of
+// lines appended
+static int append_batches(rope_t *rope, line_batch_t *batch)
+{
+    int count = 0;
+
+    while (batch != NULL)
+    {
+        line_batch_t *next = batch->next;
+
+        rope_insert(rope, rope_line_count(rope), batch->lines, batch->count);
+        count += batch->count;
+
+        free(batch->lines);
+        free(batch);
+
+        batch = next;
+    }
+
+    return count;
+}
+
+
+static void *load_in_background(void *arg)
+{
+    struct buffer_loader *ld = arg;
+
+    const char *start = ld->content;
+    // Keep the first part small, so the first screen can be shown right away
+    size_t segment_size = LOAD_FIRST_SEGMENT_SIZE;
+    int line_count = 0, expected_lines = 1;
+
+    while (start < ld->end)
+    {
+        const char *segment_end = ld->end;
+
+        if ((size_t)(ld->end - start) > segment_size)
+        {
+            const char *newline = memchr(start + segment_size, '\n', ld->end - start - segment_size);
+            segment_end = newline ? (newline + 1) : ld->end;
+        }
+
+        // Build the tree here, so the main thread only has to merge it
+        rope_t segment;
+        rope_init(&segment);
+        rope_set_geometry(&segment, linenr_columns(expected_lines), ld->row_width);
+
+        line_count += append_batches(&segment, split_content(start, segment_end));
+
+        // Extrapolate the line count from the first segment, so the line
+        // numbers (and thus the rows of all lines) do not have to change
+        // whenever the count grows by another digit
+        if (start == ld->content)
+        {
+            size_t estimate = (size_t)line_count * (ld->end - ld->content) / (segment_end - ld->content);
+            expected_lines = (estimate < INT_MAX) ? (int)estimate : INT_MAX;
+        }
+        if (expected_lines < line_count)
+            expected_lines = line_count;
+
+        rope_set_geometry(&segment, linenr_columns(expected_lines), ld->row_width);
+
+
+        pthread_mutex_lock(&ld->lock);
+
+        // Only needs to recount anything if the estimate was too low
+        rope_set_geometry(&ld->pending, segment.row_prefix, segment.row_width);
+        rope_append(&ld->pending, &segment);
+
+        ld->expected_lines = expected_lines;
+        ld->indexed_end = segment_end;
+        bool cancel = ld->cancel;
+
+        pthread_cond_broadcast(&ld->indexed);
+        pthread_mutex_unlock(&ld->lock);
+
+
+        if (cancel)
             break;
 
-        if (newline && (newline != content_pos) && (newline[-1] == '\r'))
-            newline[-1] = 0;
+        start = segment_end;
+        segment_size = LOAD_SEGMENT_SIZE;
+    }
+
+    pthread_mutex_lock(&ld->lock);
+    ld->done = true;
+    pthread_cond_broadcast(&ld->indexed);
+    pthread_mutex_unlock(&ld->lock);
+
+    // Show the whole file right away instead of at the next progress update
+    input_notify();
+
+    return NULL;
+}
+
+
+static void free_loader(buffer_t *buf)
+{
+    struct buffer_loader *ld = buf->loader;
+
+    pthread_join(ld->thread, NULL);
+
+    rope_clear(&ld->pending);
+
+    pthread_cond_destroy(&ld->indexed);
+    pthread_mutex_destroy(&ld->lock);
+    free(ld);
+
+    buf->loader = NULL;
+}
+
+
+// Cancels indexing the file in the background
+static void stop_loading(buffer_t *buf)
+{
+    if (buf->loader == NULL)
+        return;
+
+    pthread_mutex_lock(&buf->loader->lock);
+    buf->loader->cancel = true;
+    pthread_mutex_unlock(&buf->loader->lock);
+
+    free_loader(buf);
+}
+
+
+static bool start_loading(buffer_t *buf)
+{
+    struct buffer_loader *ld = malloc(sizeof(*ld));
+
+    *ld = (struct buffer_loader){
+        .content = buf->content,
+        .end = buf->content + buf->content_size,
+        .row_width = buffer_width,
+        .reserved_lines = 0,
+        .expected_lines = 0,
+        .indexed_end = buf->content,
+        .done = false,
+        .cancel = false
+    };
+
+    rope_init(&ld->pending);
+    pthread_mutex_init(&ld->lock, NULL);
+    pthread_cond_init(&ld->indexed, NULL);
+
+    if (pthread_create(&ld->thread, NULL, load_in_background, ld))
+    {
+        pthread_cond_destroy(&ld->indexed);
+        pthread_mutex_destroy(&ld->lock);
+        free(ld);
+        return false;
+    }
+
+    buf->loader = ld;
+
+    return true;
+}
+
+
+bool buffer_update_loading(buffer_t *buf)
+{
+    struct buffer_loader *ld = buf->loader;
+
+    if (ld == NULL)
+        return false;
+
+
+    pthread_mutex_lock(&ld->lock);
+
+    int new_lines = rope_line_count(&ld->pending);
+    buf->line_count += new_lines;
+    ld->reserved_lines = ld->expected_lines;
+
+    // Count the rows the way the pending lines already are, so merging them
+    // is cheap
+    buffer_update_geometry(buf);
+    rope_append(&buf->lines, &ld->pending);
+
+    bool done = ld->done;
+
+    pthread_mutex_unlock(&ld->lock);
+
+
+    if (done)
+    {
+        free_loader(buf);
 
-        buf->lines[i] = strdup(content_pos);
+        if (!buf->line_count)
+            add_empty_line(buf);
+    }
+
+    buffer_update_geometry(buf);
+
+    return done || new_lines;
+}
+
+
+void buffer_await_lines(buffer_t *buf, int count)
+{
+    while ((buf->line_count < count) && (buf->loader != NULL))
+    {
+        struct buffer_loader *ld = buf->loader;
 
-        content_pos = newline ? (newline + 1) : NULL;
+        pthread_mutex_lock(&ld->lock);
+        while (!rope_line_count(&ld->pending) && !ld->done)
+            pthread_cond_wait(&ld->indexed, &ld->lock);
+        pthread_mutex_unlock(&ld->lock);
+
+        buffer_update_loading(buf);
     }
+}
+
+
+void buffer_update_geometry(buffer_t *buf)
+{
+    int line_count = buf->line_count;
+
+    if ((buf->loader != NULL) && (buf->loader->reserved_lines > line_count))
+        line_count = buf->loader->reserved_lines;
+
+    buf->linenr_width = get_decimal_length(line_count);
+    rope_set_geometry(&buf->lines, linenr_columns(line_count), buffer_width);
+}
+
+
+void buffer_update_screen_size(buffer_t *buf)
+{
+    buf->line_screen_pos = realloc(buf->line_screen_pos, (buffer_height > 0 ? buffer_height : 1) * sizeof(*buf->line_screen_pos));
+
+    buffer_update_geometry(buf);
+}
+
+
+int buffer_load_progress(buffer_t *buf)
+{
+    struct buffer_loader *ld = buf->loader;
+
+    if (ld == NULL)
+        return 100;
+
+    pthread_mutex_lock(&ld->lock);
+    size_t indexed = ld->indexed_end - ld->content;
+    pthread_mutex_unlock(&ld->lock);
+
+    return indexed * 100 / buf->content_size;
+}
+
+
+bool buffer_load(buffer_t *buf, const char *source)
+{
+    // Keep the old content until all lines pointing into it are gone
+    buffer_t old = *buf;
+
+    if (!load_content(buf, source))
+        return false;
+
+    startup_phase("buffer_load %s: content", source);
+
+    stop_loading(buf);
+
+    free(buf->location);
+    rope_clear(&buf->lines);
+    release_content(&old);
+
+
+    buf->location = strdup(source);
+
+    buf->x = buf->y = buf->ys = 0;
+    buf->modified = false;
+    buf->line_count = 0;
+    buf->grown_line = -1;
+
+    // Huge files are indexed in the background; only wait for the first screen
+    if ((buf->content_size < BACKGROUND_LOAD_MIN_SIZE) || !start_loading(buf))
+        buf->line_count = append_batches(&buf->lines, split_content(buf->content, buf->content + buf->content_size));
+    else
+        buffer_await_lines(buf, term_height);
+
+    if (!buf->line_count) // Empty file
+        add_empty_line(buf);
+
+    buffer_update_geometry(buf);
 
 
     update_buffer_name(buf);
 
+    startup_phase("buffer_load %s: lines (%i%s)", source, buf->line_count, buf->loader ? " so far" : "");
+
 
     return true;
 }
 
 
+static void write_line(line_t *line, void *info)
+{
+    fwrite(line->text, 1, line->len, info);
+    fputc('\n', info);
+}
+
+
+static void materialize_line_cb(line_t *line, void *info)
+{
+    materialize_line(info, line);
+}
+
+
 bool buffer_write(buffer_t *buf, const char *target)
 {
     const char *fname = target ? target : buf->location;
@@ -140,17 +1004,100 @@ bool buffer_write(buffer_t *buf, const char *target)
     if (!fname)
         return false;
 
-    FILE *fp = fopen(fname, "w");
+    buffer_await_lines(buf, INT_MAX);
+
+    // Unmodified lines may point into a mapping of the very file that is to be
+    // overwritten, so write to a temporary file and then move it over the
+    // target. Resolve symlinks first, so they stay intact.
+    char *real_fname = realpath(fname, NULL);
+    const char *dest = real_fname ? real_fname : fname;
+
+    struct stat st;
+    bool exists = !stat(dest, &st);
+
+    char *tmp_fname = NULL;
+    int fd = -1;
+    FILE *fp = NULL;
+
+    // Replacing the file would break hard links to it
+    if (!exists || (st.st_nlink <= 1))
+    {
+        tmp_fname = malloc(strlen(dest) + 8);
+        sprintf(tmp_fname, "%s.XXXXXX", dest);
+
+        fd = mkstemp(tmp_fname);
+    }
+
+    if (fd >= 0)
+    {
+        if (exists)
+        {
+            // If the owner cannot be kept, the file has to be overwritten in
+            // place after all (ACLs and extended attributes are lost either way)
+            if (((st.st_uid != geteuid()) || (st.st_gid != getegid())) && fchown(fd, st.st_uid, st.st_gid))
+            {
+                close(fd);
+                unlink(tmp_fname);
+                fd = -1;
+            }
+            else
+                fchmod(fd, st.st_mode & 07777);
+        }
+        else
+        {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+        }
+    }
+
+    if (fd >= 0)
+        fp = fdopen(fd, "w");
+    else
+    {
+        // Cannot (or must not) create a new file, so overwrite the target in
+        // place, which requires copying all lines out of the mapping first
+        free(tmp_fname);
+        tmp_fname = NULL;
+
+        if (buf->mapping != NULL)
+            rope_foreach(&buf->lines, materialize_line_cb, buf);
+
+        fp = fopen(dest, "w");
+    }
+
     if (fp == NULL)
+    {
+        if (tmp_fname)
+        {
+            close(fd);
+            unlink(tmp_fname);
+        }
+
+        free(tmp_fname);
+        free(real_fname);
         return false;
+    }
 
-    for (int i = 0; i < buf->line_count; i++)
+    rope_foreach(&buf->lines, write_line, fp);
+
+    bool failed = (fclose(fp) != 0);
+
+    if (tmp_fname)
     {
-        fputs(buf->lines[i], fp);
-        fputc('\n', fp);
+        if (failed || rename(tmp_fname, dest))
+        {
+            unlink(tmp_fname);
+            failed = true;
+        }
+
+        free(tmp_fname);
     }
 
-    fclose(fp);
+    free(real_fname);
+
+    if (failed)
+        return false;
 
     if (target)
     {
@@ -206,9 +1153,9 @@ void buffer_destroy(buffer_t *buf)
     free(buf->location);
     free(buf->name);
 
-    for (int i = 0; i < buf->line_count; i++)
-        free(buf->lines[i]);
-    free(buf->lines);
+    stop_loading(buf);
+    rope_clear(&buf->lines);
+    release_content(buf);
     free(buf->line_screen_pos);
 
     free(buf);
@@ -219,9 +1166,60 @@ void buffer_destroy(buffer_t *buf)
 }
 
 
-static void ensure_line_size(char **lineptr, size_t len)
+line_t *buffer_line(buffer_t *buf, int line)
+{
+    return rope_line(&buf->lines, line);
+}
+
+
+void buffer_compact_line(buffer_t *buf)
+{
+    if ((buf->grown_line < 0) || (buf->grown_line == buf->y))
+        return;
+
+    line_t *line = buffer_line(buf, buf->grown_line);
+    rope_resize_line(&buf->lines, line, line->len + 1);
+
+    buf->grown_line = -1;
+}
+
+
+// Grows the line geometrically, so that typing does not reallocate it on every
+// key press
+static void ensure_line_size(buffer_t *buf, line_t *line, size_t len)
+{
+    if (len + 1 <= line->capacity)
+        return;
+
+    size_t capacity = line->capacity * 2;
+    if (capacity < len + 1)
+        capacity = len + 1;
+
+    rope_resize_line(&buf->lines, line, capacity);
+
+    buf->grown_line = buf->y;
+}
+
+
+// Appends a line consisting of a copy of text[0..len) and tail[0..tail_len) to
+// the array
+static void append_new_line(buffer_t *buf, line_t **lines, int *count, int *capacity, const char *text, size_t len, const char *tail, size_t tail_len)
 {
-    *lineptr = realloc(*lineptr, len + 1);
+    if (*count >= *capacity)
+        *lines = realloc(*lines, (*capacity *= 2) * sizeof(**lines));
+
+    line_t *line = &(*lines)[(*count)++];
+
+    *line = (line_t){ .text = (char *)"", .len = 0, .capacity = 0 };
+    rope_resize_line(&buf->lines, line, len + tail_len + 1);
+    line->len = len + tail_len;
+
+    memcpy(line->text, text, len);
+    memcpy(&line->text[len], tail, tail_len);
+    line->text[line->len] = 0;
+
+    update_line_info(line);
+    line->valid_utf8 = utf8_validate(line->text, line->len);
 }
 
 
@@ -229,100 +1227,218 @@ void buffer_insert(buffer_t *buf, const char *string)
 {
     buf->modified = true;
 
-    int ofs = utf8_byte_offset(buf->lines[buf->y], buf->x);
+    buffer_compact_line(buf);
+
+    line_t *line = buffer_line(buf, buf->y);
+    materialize_line(buf, line);
 
-    size_t line_len = strlen(buf->lines[buf->y]);
+    size_t ofs = buffer_line_seek(buf, line, buf->x, INT_MAX).offset;
 
     const char *nl = strchr(string, '\n');
     if (!nl)
     {
         size_t str_len = strlen(string);
+        int str_chars = utf8_strlen(string);
 
-        ensure_line_size(&buf->lines[buf->y], line_len + str_len);
-        memmove(&buf->lines[buf->y][ofs + str_len], &buf->lines[buf->y][ofs], line_len - ofs + 1);
-        memcpy(&buf->lines[buf->y][ofs], string, str_len);
+        ensure_line_size(buf, line, line->len + str_len);
+        memmove(&line->text[ofs + str_len], &line->text[ofs], line->len - ofs + 1);
+        memcpy(&line->text[ofs], string, str_len);
 
-        buf->x += utf8_strlen(string);
+        line->len += str_len;
+
+        if (line->tabs || strchr(string, '\t'))
+            recalc_line(buf, line);
+        else
+        {
+            int str_width = utf8_strlen_vis(string);
+
+            line->chars += str_chars;
+            line->width += str_width;
+            line->valid_utf8 = line->valid_utf8 && utf8_validate(string, str_len);
+            move_checkpoints(buf, line, ofs, 0, str_len, str_chars, str_width);
+        }
+
+        rope_update(&buf->lines, buf->y);
+
+        buf->x += str_chars;
 
         return;
     }
 
 
+    // Split the string only once and insert all new lines at once; whatever
+    // follows the cursor moves behind the last new line
+    const char *tail = &line->text[ofs], *end = nl + strlen(nl);
+    size_t tail_len = line->len - ofs;
+
+    int new_count = 0, new_capacity = 16;
+    line_t *new_lines = malloc(new_capacity * sizeof(*new_lines));
+
+    const char *found[256], *start = nl + 1;
+    size_t found_count;
+
+    do
+    {
+        found_count = find_newlines(start, end - start, found, sizeof(found) / sizeof(found[0]));
+
+        for (size_t i = 0; i < found_count; i++)
+        {
+            append_new_line(buf, &new_lines, &new_count, &new_capacity, start, found[i] - start, "", 0);
+            start = found[i] + 1;
+        }
+    }
+    while (found_count == sizeof(found) / sizeof(found[0]));
+
+    append_new_line(buf, &new_lines, &new_count, &new_capacity, start, end - start, tail, tail_len);
+
+
+    // Now the tail may be overwritten by the string's first line
     size_t str_len = nl - string;
+    size_t old_len = line->len;
 
-    buf->lines = realloc(buf->lines, ++buf->line_count * sizeof(*buf->lines));
-    buf->line_screen_pos = realloc(buf->line_screen_pos, buf->line_count * sizeof(*buf->line_screen_pos));
-    // Other corrections to line_screen_pos are not necessary, since that array
-    // needs to be updated anyway (if buf == active_buffer).
+    if (!line->tabs)
+        line->width -= utf8_strnlen_vis(tail, tail_len);
 
-    buf->linenr_width = get_decimal_length(buf->line_count);
+    ensure_line_size(buf, line, ofs + str_len);
+    memcpy(&line->text[ofs], string, str_len);
+    line->text[ofs + str_len] = 0;
 
-    memmove(&buf->lines[buf->y + 2], &buf->lines[buf->y + 1], (buf->line_count - buf->y - 2) * sizeof(*buf->lines));
+    line->len = ofs + str_len;
+    line->chars = buf->x + utf8_strnlen(string, str_len);
+
+    if (line->tabs || memchr(string, '\t', str_len))
+        recalc_line(buf, line);
+    else
+    {
+        line->width += utf8_strnlen_vis(string, str_len);
+        line->valid_utf8 = line->valid_utf8 && utf8_validate(string, str_len);
+        move_checkpoints(buf, line, ofs, old_len - ofs, str_len, 0, 0);
+    }
 
-    buf->lines[buf->y + 1] = malloc(line_len - ofs + 1);
+    rope_update(&buf->lines, buf->y);
 
-    strcpy(buf->lines[buf->y + 1], &buf->lines[buf->y][ofs]);
+    rope_insert(&buf->lines, buf->y + 1, new_lines, new_count);
+    free(new_lines);
+    // Corrections to line_screen_pos are not necessary, since that array needs
+    // to be updated anyway (if buf == active_buffer).
 
-    ensure_line_size(&buf->lines[buf->y], ofs + str_len);
-    memcpy(&buf->lines[buf->y][ofs], string, str_len);
-    buf->lines[buf->y][ofs + str_len] = 0;
+    buf->line_count += new_count;
+    buffer_update_geometry(buf);
 
 
-    buf->x = 0;
-    buf->y++;
+    buf->x = utf8_strnlen(start, end - start);
+    buf->y += new_count;
+}
 
 
-    if (nl[1])
-        buffer_insert(buf, nl + 1);
+// Cuts off the line at the given character/byte position
+static void truncate_line(buffer_t *buf, line_t *line, int chars, size_t ofs)
+{
+    size_t old_len = line->len;
+
+    if (!line->tabs)
+        line->width -= utf8_strlen_vis(&line->text[ofs]);
+
+    line->text[ofs] = 0;
+    line->len = ofs;
+    line->chars = chars;
+
+    if (line->tabs)
+        recalc_line(buf, line);
+    else
+        move_checkpoints(buf, line, ofs, old_len - ofs, 0, 0, 0);
 }
 
 
 void buffer_delete(buffer_t *buf, int char_count)
 {
-    while (char_count > 0)
+    if (char_count <= 0)
+        return;
+
+    buffer_compact_line(buf);
+
+    line_t *line = buffer_line(buf, buf->y);
+    materialize_line(buf, line);
+
+    int remaining = line->chars - buf->x;
+    size_t x_offset = buffer_line_seek(buf, line, buf->x, INT_MAX).offset;
+
+
+    if (remaining >= char_count)
     {
-        int remaining = utf8_strlen(buf->lines[buf->y]) - buf->x;
-        int x_offset = utf8_byte_offset(buf->lines[buf->y], buf->x);
+        int bytes = utf8_byte_offset(&line->text[x_offset], char_count);
+        int width = line->tabs ? 0 : utf8_strnlen_vis(&line->text[x_offset], bytes);
 
+        memmove(&line->text[x_offset], &line->text[x_offset + bytes], line->len - x_offset - bytes + 1); // inkl. NUL
+        line->len -= bytes;
+        line->chars -= char_count;
+        line->width -= width;
 
-        if (remaining == char_count)
-            buf->lines[buf->y][x_offset] = 0;
-        else if (remaining > char_count)
-        {
-            int bytes = utf8_byte_offset(&buf->lines[buf->y][x_offset], char_count);
-            memmove(&buf->lines[buf->y][x_offset], &buf->lines[buf->y][x_offset + bytes], strlen(&buf->lines[buf->y][x_offset + bytes]) + 1); // inkl. NUL
-        }
+        if (line->tabs)
+            recalc_line(buf, line);
         else
-        {
-            if (buf->line_count <= buf->y + 1)
-            {
-                buf->lines[buf->y][x_offset] = 0;
-                break;
-            }
+            move_checkpoints(buf, line, x_offset, bytes, 0, -char_count, -width);
 
+        buf->modified = true;
+    }
+    else
+    {
+        // Find the end of the range first (every newline counts as a
+        // character), so all lines in between can be removed at once
+        int last = buf->y, last_x = line->chars;
+        char_count -= remaining;
 
-            // TODO: Optimize (multiple lines at once, if necessary)
-            size_t next_line_length = strlen(buf->lines[buf->y + 1]);
+        while (char_count > 0)
+        {
+            buffer_await_lines(buf, last + 2);
+            if (last + 1 >= buf->line_count)
+                break; // Delete up to EOF
 
-            buf->lines[buf->y] = realloc(buf->lines[buf->y], x_offset + next_line_length + 1);
-            memmove(&buf->lines[buf->y][x_offset], buf->lines[buf->y + 1], next_line_length + 1);
+            line_t *last_line = buffer_line(buf, ++last);
+            char_count--; // newline
 
-            free(buf->lines[buf->y + 1]);
-            memmove(&buf->lines[buf->y + 1], &buf->lines[buf->y + 2], (--buf->line_count - buf->y - 1) * sizeof(buf->lines[0]));
+            last_x = (char_count < last_line->chars) ? char_count : last_line->chars;
+            char_count -= last_x;
+        }
 
-            buf->linenr_width = get_decimal_length(buf->line_count);
+        truncate_line(buf, line, buf->x, x_offset);
 
-            remaining++; // newline
-        }
+        if (last > buf->y)
+        {
+            // Append what remains of the last line
+            line_t *last_line = buffer_line(buf, last);
+            size_t tail_offset = utf8_byte_offset(last_line->text, last_x);
+            size_t tail_len = last_line->len - tail_offset;
+
+            ensure_line_size(buf, line, x_offset + tail_len);
+            memcpy(&line->text[x_offset], &last_line->text[tail_offset], tail_len);
+            line->len = x_offset + tail_len;
+            line->text[line->len] = 0;
+            line->chars += last_line->chars - last_x;
+
+            if (line->tabs || last_line->tabs)
+                recalc_line(buf, line);
+            else
+            {
+                line->width += utf8_strnlen_vis(&last_line->text[tail_offset], tail_len);
+                line->valid_utf8 = line->valid_utf8 && last_line->valid_utf8;
+                move_checkpoints(buf, line, x_offset, 0, tail_len, 0, 0);
+            }
 
+            rope_remove(&buf->lines, buf->y + 1, last - buf->y);
 
-        char_count -= remaining;
+            buf->line_count -= last - buf->y;
+            buffer_update_geometry(buf);
+        }
 
-        buf->modified = true;
+        if (remaining || (last > buf->y))
+            buf->modified = true;
     }
 
+    rope_update(&buf->lines, buf->y);
+
 
-    int current_line_length = utf8_strlen(buf->lines[buf->y]);
+    int current_line_length = line->chars;
     if (buf->x >= current_line_length)
         buf->x = (input_mode == MODE_INSERT) ? current_line_length : (current_line_length ? (current_line_length - 1) : 0);
 }
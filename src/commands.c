@@ -1,12 +1,15 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "buffer.h"
 #include "commands.h"
 #include "editor.h"
 #include "syntax.h"
 #include "term.h"
+#include "tools.h"
+#include "utf8.h"
 
 
 #define error_assert(condition, ...) if (!(condition)) { error(__VA_ARGS__); return; }
@@ -162,6 +165,173 @@ static void buf_edit(char **cmd_line)
 }
 
 
+// Prints the memory used for the active buffer's lines (in use/allocated)
+static void memstat(char **cmd_line)
+{
+    error_assert(!cmd_line[1], "Unexpected parameter.");
+
+    const rope_t *lines = &active_buffer->lines;
+
+    size_t text_used = 0, text_chunks = 0;
+    for (int i = 0; i < TEXT_HEAP_CLASSES; i++)
+    {
+        text_used += lines->text.classes[i].used_objects * lines->text.classes[i].object_size;
+        text_chunks += lines->text.classes[i].chunk_count;
+    }
+
+    term_cursor_pos(0, term_height - 1);
+    syntax_region(SYNREG_DEFAULT);
+    term_printf("Nodes: %zu/%zu KiB, text: %zu/%zu KiB, %zu large: %zu KiB",
+                lines->nodes.used_objects * lines->nodes.object_size >> 10,
+                lines->nodes.chunk_count * SLAB_CHUNK_SIZE >> 10,
+                text_used >> 10, text_chunks * SLAB_CHUNK_SIZE >> 10,
+                lines->text.large_count, lines->text.large_bytes >> 10);
+}
+
+
+// Prints how much has been written to the terminal and in how many syscalls
+static void termstat(char **cmd_line)
+{
+    error_assert(!cmd_line[1], "Unexpected parameter.");
+
+    term_cursor_pos(0, term_height - 1);
+    syntax_region(SYNREG_DEFAULT);
+    term_printf("Frames: %lu, writes: %lu (at most %i per frame), %lu bytes",
+                term_stats.frames, term_stats.writes, term_stats.max_frame_writes,
+                term_stats.bytes);
+}
+
+
+// Throughput of counting characters and columns, in MB/s
+static double utf8_throughput(const char *text, size_t len, bool validate)
+{
+    int64_t start = get_time_ms(), elapsed;
+    size_t total = 0, chars, width;
+
+    do
+    {
+        if (validate)
+            utf8_validate(text, len);
+        else
+            utf8_measure(text, len, &chars, &width);
+        total += len;
+        elapsed = get_time_ms() - start;
+    }
+    while (elapsed < 100);
+
+    return (double)total / 1000. / (double)elapsed;
+}
+
+// Compares the scalar and the vectorized character counting and validation
+static void utf8bench(char **cmd_line)
+{
+    error_assert(!cmd_line[1], "Unexpected parameter.");
+
+    static const char *const samples[][2] = {
+        { "ASCII", "The quick brown fox jumps over the lazy dog. " },
+        { "CJK",   "日本語の文章と漢字。" },
+        { "mixed", "Grüße, 日本! Δέλτα x = 1; " }
+    };
+
+    const size_t size = 1 << 20;
+    char *text = malloc(size);
+
+    term_cursor_pos(0, term_height - 1);
+    syntax_region(SYNREG_DEFAULT);
+
+    for (int i = 0; i < (int)(sizeof(samples) / sizeof(samples[0])); i++)
+    {
+        size_t sample_len = strlen(samples[i][1]), len = 0;
+        while (len + sample_len <= size)
+        {
+            memcpy(&text[len], samples[i][1], sample_len);
+            len += sample_len;
+        }
+
+        double scalar[2], vector[2];
+        for (int validate = 0; validate < 2; validate++)
+        {
+            utf8_force_scalar(true);
+            scalar[validate] = utf8_throughput(text, len, validate);
+            utf8_force_scalar(false);
+            vector[validate] = utf8_throughput(text, len, validate);
+        }
+
+        term_printf("%s: %.0f -> %.0f (valid.: %.0f -> %.0f) MB/s; ", samples[i][0], scalar[0], vector[0], scalar[1], vector[1]);
+    }
+
+    term_printf("%s", utf8_implementation());
+
+    free(text);
+}
+
+
+// Throughput of finding all newlines (or of splitting the text into lines like
+// loading does), in GB/s
+static double split_throughput(const char *text, size_t len, bool split)
+{
+    const char *found[256];
+    int64_t start = get_time_ms(), elapsed;
+    size_t total = 0;
+
+    do
+    {
+        if (split)
+            buffer_split_lines(text, len);
+        else
+            for (const char *pos = text, *end = text + len; pos < end;)
+            {
+                size_t count = find_newlines(pos, end - pos, found, sizeof(found) / sizeof(found[0]));
+                pos = count ? (found[count - 1] + 1) : end;
+            }
+
+        total += len;
+        elapsed = get_time_ms() - start;
+    }
+    while (elapsed < 200);
+
+    return (double)total / 1e6 / (double)elapsed;
+}
+
+// Compares the newline search implementations on a synthetic 64 MB file of
+// lines between 0 and 127 bytes long
+static void splitbench(char **cmd_line)
+{
+    error_assert(!cmd_line[1], "Unexpected parameter.");
+
+    const size_t size = 64 << 20;
+    char *text = malloc(size);
+
+    uint32_t seed = 1;
+    for (size_t i = 0; i < size;)
+    {
+        seed = seed * 1103515245 + 12345;
+        size_t line_len = (seed >> 16) & 127;
+
+        for (size_t j = 0; (j < line_len) && (i < size - 1); j++, i++)
+            text[i] = 'a' + i % 26;
+        text[i++] = '\n';
+    }
+
+    term_cursor_pos(0, term_height - 1);
+    syntax_region(SYNREG_DEFAULT);
+
+    int impls = find_newlines_implementations();
+    for (int i = 0; i < impls; i++)
+    {
+        const char *name = find_newlines_select(i);
+        double find = split_throughput(text, size, false);
+        double split = split_throughput(text, size, true);
+
+        term_printf("%s: %.2f (split: %.2f) GB/s; ", name, find, split);
+    }
+
+    term_printf("%i lines", buffer_split_lines(text, size));
+
+    free(text);
+}
+
+
 struct cmd_handler command_handlers[] = {
     { "q", quit },
     { "q!", force_quit },
@@ -177,6 +347,10 @@ struct cmd_handler command_handlers[] = {
     { "wqa", write_and_quit_all },
     { "e", buf_edit },
     { "o", buf_edit },
+    { "memstat", memstat },
+    { "termstat", termstat },
+    { "utf8bench", utf8bench },
+    { "splitbench", splitbench },
 
     { NULL, NULL }
 };
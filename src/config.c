@@ -1,16 +1,23 @@
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <mruby.h>
 #include <mruby/array.h>
 #include <mruby/class.h>
 #include <mruby/compile.h>
 #include <mruby/data.h>
+#include <mruby/dump.h>
 #include <mruby/hash.h>
+#include <mruby/irep.h>
 #include <mruby/proc.h>
 #include <mruby/string.h>
 #include <mruby/variable.h>
+#include <mruby/version.h>
 
 #include "buffer.h"
 #include "config.h"
@@ -20,6 +27,7 @@
 #include "keycodes.h"
 #include "syntax.h"
 #include "term.h"
+#include "tools.h"
 #include "utf8.h"
 
 
@@ -186,8 +194,13 @@ static bool event_input(const event_t *event, void *info)
 {
     (void)event;
 
-    for (int i = 0; ((int *)info)[i]; i++)
-        sim_input(((int *)info)[i]);
+    const int *seq = info;
+    size_t len = 0;
+
+    while (seq[len])
+        len++;
+
+    sim_input_array(seq, len);
 
     return true;
 }
@@ -386,12 +399,15 @@ static mrb_value input(mrb_state *mrbs, mrb_value self)
 
     int len = mrb_ary_len(mrbs, wat);
     for (int i = 0; i < len; i++)
-    {
         if (!mrb_fixnum_p(mrb_ary_entry(wat, i)))
             mrb_raise(mrbs, mrbs->object_class, "Array of integers expected for input");
 
-        sim_input(mrb_fixnum(mrb_ary_entry(wat, i)));
-    }
+    int *vals = malloc(len * sizeof(*vals));
+    for (int i = 0; i < len; i++)
+        vals[i] = mrb_fixnum(mrb_ary_entry(wat, i));
+
+    sim_input_array(vals, len);
+    free(vals);
 
 
     return mrb_nil_value();
@@ -402,6 +418,10 @@ static mrb_value mrb_getc(mrb_state *mrbs, mrb_value self)
 {
     (void)self;
     (void)mrbs;
+
+    // The script may wait for the user to react to what it has drawn
+    term_flush();
+
     return mrb_fixnum_value(input_read());
 }
 
@@ -502,12 +522,16 @@ static mrb_value buffer_get_line(mrb_state *mrbs, mrb_value self)
 {
     mrb_int line;
     mrb_get_args(mrbs, "i", &line);
-    return mrb_str_new_cstr(mrbs, ((buffer_t *)DATA_PTR(self))->lines[line]);
+    buffer_await_lines(DATA_PTR(self), line + 1);
+    line_t *l = buffer_line(DATA_PTR(self), line);
+    return mrb_str_new(mrbs, l->text, l->len);
 }
 
 static mrb_value buffer_line_count(mrb_state *mrbs, mrb_value self)
 {
     (void)mrbs;
+    // The total is only known once the whole file has been indexed
+    buffer_await_lines(DATA_PTR(self), INT_MAX);
     return mrb_fixnum_value(((buffer_t *)DATA_PTR(self))->line_count);
 }
 
@@ -523,6 +547,17 @@ static mrb_value editor_scroll(mrb_state *mrbs, mrb_value self)
 }
 
 
+static mrb_value editor_scroll_rows(mrb_state *mrbs, mrb_value self)
+{
+    (void)self;
+
+    mrb_int rows;
+    mrb_get_args(mrbs, "i", &rows);
+    scroll_rows(rows);
+    return mrb_nil_value();
+}
+
+
 static mrb_value get_active_buffer_pos_from_screen(mrb_state *mrbs, mrb_value self)
 {
     (void)self;
@@ -530,33 +565,21 @@ static mrb_value get_active_buffer_pos_from_screen(mrb_state *mrbs, mrb_value se
     mrb_int x, y;
     mrb_get_args(mrbs, "ii", &x, &y);
 
-    int buf_y = -1;
-
-    for (int line = active_buffer->ys + 1; line <= active_buffer->ye; line++)
-    {
-        if (active_buffer->line_screen_pos[line] > y)
-        {
-            buf_y = line - 1;
-            break;
-        }
-    }
+    int first_row;
+    int buf_y = rope_line_at_row(&active_buffer->lines, rope_row_offset(&active_buffer->lines, active_buffer->ys) + y - 1, &first_row);
 
-    if (buf_y < 0)
+    // Rows below the text area belong to its last line, rows above to its first
+    if ((buf_y < 0) || (buf_y > active_buffer->ye))
         buf_y = active_buffer->ye;
+    if ((buf_y < active_buffer->ys) || (y < 1))
+        buf_y = active_buffer->ys;
 
 
-    int in_line_x = x - 1 - active_buffer->linenr_width - 1 + (y - active_buffer->line_screen_pos[buf_y]) * buffer_width;
+    int in_line_x = x - 1 - active_buffer->linenr_width - 1 + (y - active_buffer->line_screen_pos[buf_y - active_buffer->ys]) * buffer_width;
 
 
-    int buf_x = 0;
-
-    for (int i = 0, screen_x = 0; (screen_x < in_line_x) && active_buffer->lines[buf_y][i]; i += utf8_mbclen(active_buffer->lines[buf_y][i]), buf_x++)
-    {
-        if (active_buffer->lines[buf_y][i] != '\t')
-            screen_x += utf8_is_dbc(&active_buffer->lines[buf_y][i]) ? 2 : 1;
-        else
-            screen_x += tabstop_width - screen_x % tabstop_width;
-    }
+    line_t *line = buffer_line(active_buffer, buf_y);
+    int buf_x = buffer_line_seek(active_buffer, line, INT_MAX, in_line_x).chars;
 
 
     mrb_value ary_vals[] = { mrb_fixnum_value(buf_x), mrb_fixnum_value(buf_y) };
@@ -591,6 +614,211 @@ static mrb_value mrb_strlen(mrb_state *mrbs, mrb_value self)
 }
 
 
+// Configuration files are compiled to RITE bytecode which is cached next to
+// them (as FILE.mrb), behind this header; the cache is used as long as the
+// source is unchanged and mruby is the same version as the one that wrote it
+// (the bytecode format changes between versions)
+#define BYTECODE_CACHE_MAGIC "stdmrb2"
+
+struct bytecode_cache_header
+{
+    char magic[8];
+    char mruby_version[16];
+    uint64_t bytecode_size;
+    uint64_t source_size, source_hash;
+    int64_t source_mtime_sec, source_mtime_nsec;
+};
+
+
+// FNV-1a
+static uint64_t hash_source(const char *source, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)source[i]) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+
+// Reads the rest of the stream into a newly allocated buffer
+static char *read_stream(FILE *fp, size_t *len)
+{
+    size_t size = 4096;
+    char *data = malloc(size);
+
+    *len = 0;
+    for (size_t got; (got = fread(data + *len, 1, size - *len, fp)) > 0;)
+    {
+        *len += got;
+        if (*len == size)
+            data = realloc(data, size *= 2);
+    }
+
+    return data;
+}
+
+
+// Stores the bytecode of the given procedure in the cache
+static void write_bytecode_cache(const char *cache_path, struct bytecode_cache_header *header, struct RProc *proc)
+{
+    uint8_t *bin;
+    size_t bin_size;
+
+    if (mrb_dump_irep(gmrbs, proc->body.irep, DUMP_DEBUG_INFO, &bin, &bin_size) != MRB_DUMP_OK)
+        return;
+
+    header->bytecode_size = bin_size;
+
+    // The cache is only an optimization, so failing to write it is fine; but
+    // never leave a partially written one behind
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", cache_path);
+
+    int fd = mkstemp(tmp_path);
+    FILE *fp = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+
+    if (fp != NULL)
+    {
+        bool ok = (fwrite(header, sizeof(*header), 1, fp) == 1) && (fwrite(bin, 1, bin_size, fp) == bin_size);
+
+        if (fclose(fp) || !ok || rename(tmp_path, cache_path))
+            unlink(tmp_path);
+    }
+    else if (fd >= 0)
+    {
+        close(fd);
+        unlink(tmp_path);
+    }
+
+    mrb_free(gmrbs, bin);
+}
+
+
+// Loads the bytecode from the cache (without running it) if it is still up to
+// date (the source may be read into *source to find out)
+static struct RProc *read_bytecode_cache(const char *cache_path, FILE *fp, struct bytecode_cache_header *header, char **source, size_t *source_len)
+{
+    FILE *cfp = fopen(cache_path, "rb");
+    if (cfp == NULL)
+        return NULL;
+
+    struct stat st;
+    struct bytecode_cache_header cached;
+
+    // The bytecode has to take up exactly the rest of the file, otherwise the
+    // cache has been truncated or is corrupt
+    bool valid = !fstat(fileno(cfp), &st) &&
+                 (fread(&cached, sizeof(cached), 1, cfp) == 1) &&
+                 !memcmp(cached.magic, header->magic, sizeof(header->magic)) &&
+                 !memcmp(cached.mruby_version, header->mruby_version, sizeof(header->mruby_version)) &&
+                 (cached.bytecode_size == (uint64_t)st.st_size - sizeof(cached)) &&
+                 (cached.source_size == header->source_size);
+
+    bool fresh = false, touched = false;
+
+    if (valid)
+    {
+        fresh = (cached.source_mtime_sec == header->source_mtime_sec) && (cached.source_mtime_nsec == header->source_mtime_nsec);
+
+        // The file may only have been touched (e.g. by a checkout)
+        if (!fresh)
+        {
+            *source = read_stream(fp, source_len);
+            header->source_hash = hash_source(*source, *source_len);
+            fresh = touched = (cached.source_hash == header->source_hash);
+        }
+        else
+            header->source_hash = cached.source_hash;
+    }
+
+    // This reads the bytecode from where the header ends and copies
+    // everything it needs out of the file
+    struct RProc *proc = NULL;
+    if (fresh)
+    {
+        mrbc_context *cxt = mrbc_context_new(gmrbs);
+        cxt->no_exec = TRUE;
+
+        mrb_value proc_val = mrb_load_irep_file_cxt(gmrbs, cfp, cxt);
+        mrbc_context_free(gmrbs, cxt);
+
+        // Bytecode mruby cannot load is compiled anew, so that error is not
+        // the user's concern
+        if (mrb_type(proc_val) == MRB_TT_PROC)
+            proc = mrb_proc_ptr(proc_val);
+        gmrbs->exc = NULL;
+    }
+
+    fclose(cfp);
+
+    if ((proc != NULL) && touched)
+        write_bytecode_cache(cache_path, header, proc);
+
+    return proc;
+}
+
+
+// Runs the given configuration file (from its bytecode cache if possible);
+// exceptions are left in gmrbs->exc
+static void run_config_file(const char *path, FILE *fp)
+{
+    char cache_path[PATH_MAX];
+    snprintf(cache_path, sizeof(cache_path), "%s.mrb", path);
+
+    struct stat st;
+    fstat(fileno(fp), &st);
+
+    struct bytecode_cache_header header = {
+        .magic = BYTECODE_CACHE_MAGIC,
+        .mruby_version = MRUBY_VERSION,
+        .source_size = st.st_size,
+        .source_mtime_sec = st.st_mtim.tv_sec,
+        .source_mtime_nsec = st.st_mtim.tv_nsec
+    };
+
+    char *source = NULL;
+    size_t source_len = 0;
+
+    struct RProc *proc = read_bytecode_cache(cache_path, fp, &header, &source, &source_len);
+    if (proc != NULL)
+        startup_phase("load_config: %s (cached bytecode)", path);
+    else
+    {
+        if (source == NULL)
+        {
+            source = read_stream(fp, &source_len);
+            header.source_hash = hash_source(source, source_len);
+        }
+
+        mrbc_context *cxt = mrbc_context_new(gmrbs);
+        mrbc_filename(gmrbs, cxt, path);
+        cxt->no_exec = TRUE;
+
+        mrb_value proc_val = mrb_load_nstring_cxt(gmrbs, source, source_len, cxt);
+        mrbc_context_free(gmrbs, cxt);
+
+        // Syntax errors
+        if ((gmrbs->exc != NULL) || (mrb_type(proc_val) != MRB_TT_PROC))
+        {
+            free(source);
+            return;
+        }
+
+        proc = mrb_proc_ptr(proc_val);
+        write_bytecode_cache(cache_path, &header, proc);
+
+        startup_phase("load_config: %s (compiled)", path);
+    }
+
+    free(source);
+
+    mrb_top_run(gmrbs, proc, mrb_top_self(gmrbs), 0);
+    startup_phase("load_config: %s (run)", path);
+}
+
+
 void load_config(void)
 {
     FILE *fp = fopen(".stdrc", "r");
@@ -603,19 +831,21 @@ void load_config(void)
 
 
     gmrbs = mrb_open();
+    startup_phase("load_config: mruby");
 
 
+    // Parse all of these at once instead of one by one
+    char definitions[SYNREG_COUNT * 128];
+    size_t definitions_len = 0;
     for (int i = 0; i < SYNREG_COUNT; i++)
-    {
-        char definition[128];
-        sprintf(definition, "def %s *opts\n[%i, opts.reduce(:merge)]\nend\n", syntax_names[i], i);
-        mrb_load_string(gmrbs, definition);
-    }
+        definitions_len += snprintf(definitions + definitions_len, sizeof(definitions) - definitions_len, "def %s *opts\n[%i, opts.reduce(:merge)]\nend\n", syntax_names[i], i);
+    mrb_load_nstring(gmrbs, definitions, definitions_len);
+    startup_phase("load_config: syntax definitions");
 
     FILE *mpfp = fopen(".stdrc.patches", "r");
     if (mpfp)
     {
-        mrb_load_file(gmrbs, mpfp);
+        run_config_file(".stdrc.patches", mpfp);
         fclose(mpfp);
 
         if (gmrbs->exc != NULL)
@@ -660,6 +890,7 @@ void load_config(void)
     mrb_define_alias(gmrbs, buflincls, "size", "length");
 
     mrb_define_method(gmrbs, gmrbs->object_class, "scroll", &editor_scroll, ARGS_REQ(1));
+    mrb_define_method(gmrbs, gmrbs->object_class, "scroll_rows", &editor_scroll_rows, ARGS_REQ(1));
 
 
     mrb_define_method(gmrbs, gmrbs->object_class, "get_active_buffer_pos_from_screen", &get_active_buffer_pos_from_screen, ARGS_REQ(2));
@@ -671,8 +902,10 @@ void load_config(void)
     mrb_define_method(gmrbs, strcls, "length", &mrb_strlen, ARGS_NONE());
     mrb_define_alias(gmrbs, strcls, "size", "length");
 
+    startup_phase("load_config: builtins");
+
 
-    mrb_load_file(gmrbs, fp);
+    run_config_file(".stdrc", fp);
     fclose(fp);
 
 
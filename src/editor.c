@@ -1,7 +1,9 @@
 #include <ctype.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,6 +22,14 @@
 #include "utf8.h"
 
 
+// Milliseconds between status bar updates while a file is indexed
+#define LOAD_PROGRESS_INTERVAL 100
+
+// Milliseconds for which showing a frame may be put off while there is still
+// input to process
+#define MAX_FRAME_DELAY 50
+
+
 static int desired_cursor_x = 0;
 
 enum input_mode input_mode = MODE_NORMAL;
@@ -28,102 +38,133 @@ enum input_mode input_mode = MODE_NORMAL;
 // Screen lines required
 static int slr(buffer_t *buf, int line)
 {
-    return (1 + buf->linenr_width + 1 + utf8_strlen_vis(buf->lines[line]) + buffer_width - 1) / buffer_width;
+    return (1 + buf->linenr_width + 1 + buffer_line(buf, line)->width + buffer_width - 1) / buffer_width;
+}
+
+
+// Returns the first line on screen if the given line is to be the last one
+static int top_line_for(int line)
+{
+    const rope_t *lines = &active_buffer->lines;
+
+    int top_row = rope_row_offset(lines, line + 1) - buffer_height;
+    if (top_row <= 0)
+        return 0;
+
+    // Lines can only be displayed completely
+    int first_row, top = rope_line_at_row(lines, top_row, &first_row);
+    if (first_row < top_row)
+        top++;
+
+    return (top < line) ? top : line;
+}
+
+
+// Prints the character at the given byte offset together with the zero-width
+// characters following it (or a space for tabs and the end of the line)
+static void put_char_cell(const line_t *line, int i)
+{
+    if ((i >= (int)line->len) || (line->text[i] == '\t'))
+    {
+        term_putchar(' ');
+        return;
+    }
+
+    do
+    {
+        for (size_t k = utf8_char_size(&line->text[i], line->len - i); k > 0; k--)
+            term_putchar(line->text[i++]);
+    }
+    while ((i < (int)line->len) && !utf8_width(&line->text[i], line->len - i));
 }
 
 
 void reposition_cursor(bool update_desire)
 {
+    buffer_compact_line(active_buffer);
+
     term_cursor_pos(term_width - 16, term_height - 2);
     syntax_region(SYNREG_STATUSBAR);
-    int position = printf("%i,%i", active_buffer->y + 1, active_buffer->x + 1);
-    printf("%*c", 13 - position, ' ');
+    int position = term_printf("%i,%i", active_buffer->y + 1, active_buffer->x + 1);
+    term_printf("%*c", 13 - position, ' ');
 
 
     static int old_x = -1, old_y = -1;
 
+    // The terminal may have shrunk since
+    if ((old_x >= term_width) || (old_y >= term_height - 2))
+        old_x = -1;
+
     if (old_x >= 0)
     {
-        int old_line = -1, old_buf_i;
-
-        // TODO: Optimize
-        for (int line = active_buffer->ys + 1; line <= active_buffer->ye; line++)
-        {
-            if (active_buffer->line_screen_pos[line] > old_y)
-            {
-                old_line = line - 1;
-                break;
-            }
-        }
+        int first_row, old_buf_i;
+        int old_line = rope_line_at_row(&active_buffer->lines, rope_row_offset(&active_buffer->lines, active_buffer->ys) + old_y - 1, &first_row);
 
         term_cursor_pos(old_x, old_y);
 
-        if (old_line < 0)
+        if ((old_line < 0) || (old_line > active_buffer->ye))
         {
-            if (old_y < active_buffer->line_screen_pos[active_buffer->ye] + slr(active_buffer, active_buffer->ye))
-                old_line = active_buffer->ye;
-            else
-            {
-                syntax_region(SYNREG_PLACEHOLDER_EMPTY);
-                putchar(old_x ? ' ' : '~');
-            }
+            old_line = -1;
+            syntax_region(SYNREG_PLACEHOLDER_EMPTY);
+            term_putchar(old_x ? ' ' : '~');
         }
 
         if (old_line >= 0)
         {
-            int old_in_line_x = old_x - 1 - active_buffer->linenr_width - 1 + (old_y - active_buffer->line_screen_pos[old_line]) * buffer_width;
-            int x = 0;
-            old_buf_i = 0;
+            line_t *old = buffer_line(active_buffer, old_line);
+            const char *old_text = old->text;
+            int old_in_line_x = old_x - 1 - active_buffer->linenr_width - 1 + (old_y - active_buffer->line_screen_pos[old_line - active_buffer->ys]) * buffer_width;
+            line_pos_t pos = buffer_line_seek(active_buffer, old, INT_MAX, old_in_line_x);
+            int x = pos.column;
+            old_buf_i = pos.offset;
 
-            while ((x < old_in_line_x) && active_buffer->lines[old_line][old_buf_i])
-            {
-                if (active_buffer->lines[old_line][old_buf_i] != '\t')
-                    x += utf8_is_dbc(&active_buffer->lines[old_line][old_buf_i]) ? 2 : 1;
-                else
-                    x += tabstop_width - x % tabstop_width;
-
-                old_buf_i += utf8_mbclen(active_buffer->lines[old_line][old_buf_i]);
-            }
+            // Zero-width characters belong to the one in front of them
+            while ((old_buf_i < (int)old->len) && !utf8_width(&old_text[old_buf_i], old->len - old_buf_i))
+                old_buf_i += utf8_char_size(&old_text[old_buf_i], old->len - old_buf_i);
 
             syntax_region(SYNREG_DEFAULT);
-            if ((x < old_in_line_x) || !active_buffer->lines[old_line][old_buf_i] || (active_buffer->lines[old_line][old_buf_i] == '\t'))
-                putchar(' ');
+            if (x < old_in_line_x)
+                term_putchar(' ');
             else
-                for (int i = 0; i < utf8_mbclen(active_buffer->lines[old_line][old_buf_i]); i++)
-                    putchar(active_buffer->lines[old_line][old_buf_i + i]);
+                put_char_cell(old, old_buf_i);
         }
     }
 
 
-    int x = 0, i, j, dbc = 0;
-    for (i = j = 0; j < active_buffer->x; i += utf8_mbclen(active_buffer->lines[active_buffer->y][i]), j++)
-    {
-         if (utf8_is_dbc(&(active_buffer->lines[active_buffer->y][i])))
-         {
-             dbc++;
-         }
+    line_t *line = buffer_line(active_buffer, active_buffer->y);
+    const char *text = line->text;
 
-        if (active_buffer->lines[active_buffer->y][i] == '\t')
-            x += tabstop_width - x % tabstop_width;
-        else
-            x++;
+    int x, i;
+    if (active_buffer->x >= line->chars)
+    {
+        // Cursor at the end of the line
+        i = line->len;
+        x = line->width;
+    }
+    else
+    {
+        line_pos_t pos = buffer_line_seek(active_buffer, line, active_buffer->x, INT_MAX);
+        x = pos.column;
+        i = pos.offset;
+
+        // The cursor cannot be shown on a zero-width character, so it goes
+        // to the next one
+        while ((i < (int)line->len) && !utf8_width(&text[i], line->len - i))
+            i += utf8_char_size(&text[i], line->len - i);
     }
 
     if (update_desire)
-        desired_cursor_x = x + dbc;
+        desired_cursor_x = x;
 
 
     // Wait with this test until here, so that desired_cursor_x may be updated
     if ((active_buffer->y < active_buffer->ys) || (active_buffer->y > active_buffer->ye))
-    {
-        fflush(stdout);
         return;
-    }
 
 
-    x += 1 + active_buffer->linenr_width + 1 + dbc;
+    x += 1 + active_buffer->linenr_width + 1;
 
-    int y = active_buffer->line_screen_pos[active_buffer->y] + x / buffer_width;
+    int y = active_buffer->line_screen_pos[active_buffer->y - active_buffer->ys] + x / buffer_width;
 
     x %= buffer_width;
 
@@ -132,17 +173,10 @@ void reposition_cursor(bool update_desire)
 
     syntax_region(SYNREG_DEFAULT);
     term_invert(true);
-    if (!active_buffer->lines[active_buffer->y][i] || (active_buffer->lines[active_buffer->y][i] == '\t'))
-        putchar(' ');
-    else
-        for (int k = 0; k < utf8_mbclen(active_buffer->lines[active_buffer->y][i]); k++)
-            putchar(active_buffer->lines[active_buffer->y][i + k]);
+    put_char_cell(line, i);
     term_invert(false);
 
     term_cursor_pos(x, y);
-
-
-    fflush(stdout);
 }
 
 
@@ -155,16 +189,7 @@ void ensure_cursor_visibility(void)
     }
     else if (active_buffer->y > active_buffer->ye)
     {
-        int lines = 0;
-        int ys = active_buffer->y;
-
-        while (lines < buffer_height)
-        {
-            lines += slr(active_buffer, ys);
-            ys--;
-        }
-
-        active_buffer->ys = ys + 1;
+        active_buffer->ys = top_line_for(active_buffer->y);
         full_redraw();
     }
 }
@@ -177,7 +202,7 @@ void error(const char *format, ...)
 
     va_list va;
     va_start(va, format);
-    vprintf(format, va);
+    term_vprintf(format, va);
     va_end(va);
 
     reposition_cursor(false);
@@ -239,22 +264,41 @@ static void command_line(void)
 {
     term_cursor_pos(0, term_height - 1);
     syntax_region(SYNREG_DEFAULT);
-    printf("%-*c", term_width - 1, ':');
+    term_printf("%-*c", term_width - 1, ':');
     term_cursor_pos(1, term_height - 1);
 
     term_show_cursor(true);
-    fflush(stdout);
+    term_flush();
 
     char cmd[128];
 
     int i = 0;
-    while ((i < 127) && ((cmd[i++] = input_read()) != '\n'))
+    while (i < 127)
     {
+        int inp = input_read();
+
+        if (inp == KEY_PASTE)
+        {
+            // Commands are only one line long
+            for (const char *pasted = input_pasted_text(); *pasted && (*pasted != '\n') && (i < 126); pasted++)
+            {
+                cmd[i++] = *pasted;
+                term_putchar(*pasted);
+            }
+
+            term_flush();
+            continue;
+        }
+
+        if ((cmd[i++] = inp) == '\n')
+            break;
+
         if (((cmd[i - 1] == ':') && (i == 1)) || !cmd[i - 1])
             cmd[--i] = 0;
         else if (cmd[i - 1] == 127)
         {
-            print_flushed("\b \b");
+            print("\b \b");
+            term_flush();
 
             cmd[--i] = 0;
             if (i)
@@ -264,13 +308,12 @@ static void command_line(void)
         }
         else
         {
-            putchar(cmd[i - 1]);
-            fflush(stdout);
+            term_putchar(cmd[i - 1]);
+            term_flush();
         }
     }
 
     term_show_cursor(false);
-    fflush(stdout);
 
     if (i <= 0)
     {
@@ -297,8 +340,7 @@ static void command_line(void)
     {
         term_cursor_pos(0, term_height - 1);
         syntax_region(SYNREG_ERROR);
-        printf("Unknown command “%s”.", cmd_line[0]);
-        fflush(stdout);
+        term_printf("Unknown command “%s”.", cmd_line[0]);
     }
 
 
@@ -308,24 +350,27 @@ static void command_line(void)
 
 static void line_change_update_x(void)
 {
+    line_t *line = buffer_line(active_buffer, active_buffer->y);
+
     if (desired_cursor_x == -1)
     {
-        int len = (int)utf8_strlen(active_buffer->lines[active_buffer->y]);
+        int len = line->chars;
         active_buffer->x = (input_mode == MODE_INSERT) ? len : (len ? (len - 1) : 0);
         return;
     }
 
 
-    int x = 0, i = 0, j = 0;
-    for (; active_buffer->lines[active_buffer->y][i] && (x < desired_cursor_x); i += utf8_mbclen(active_buffer->lines[active_buffer->y][i]), j++)
+    int x, j;
+    if (desired_cursor_x >= line->width)
     {
-        if (utf8_is_dbc(&(active_buffer->lines[active_buffer->y][i])))
-            ++x;
-
-        if (active_buffer->lines[active_buffer->y][i] == '\t')
-            x += tabstop_width - x % tabstop_width;
-        else
-            x++;
+        x = line->width;
+        j = line->chars;
+    }
+    else
+    {
+        line_pos_t pos = buffer_line_seek(active_buffer, line, INT_MAX, desired_cursor_x);
+        x = pos.column;
+        j = pos.chars;
     }
 
     if ((desired_cursor_x == x) || (input_mode == MODE_INSERT))
@@ -338,33 +383,42 @@ static void line_change_update_x(void)
 static void draw_line(buffer_t *buffer, int line)
 {
     syntax_region(SYNREG_LINENR);
-    printf(" %*i ", buffer->linenr_width, line);
+    term_printf(" %*i ", buffer->linenr_width, line);
 
+    line_t *l = buffer_line(buffer, line);
+    const char *text = l->text;
     int x = 0;
 
     syntax_region(SYNREG_DEFAULT);
-    for (int i = 0; active_buffer->lines[line][i]; i++)
+    for (size_t i = 0; i < l->len;)
     {
-        if (buffer->lines[line][i] == '\t')
+        if (text[i] == '\t')
         {
-            printf("%*c", tabstop_width - x % tabstop_width, ' ');
+            term_printf("%*c", tabstop_width - x % tabstop_width, ' ');
             x += tabstop_width - x % tabstop_width;
+            i++;
         }
         else
         {
-            putchar(buffer->lines[line][i]);
-            if ((buffer->lines[line][i] & 0xc0) != 0x80)
-            {
-                if (utf8_is_dbc(&(buffer->lines[line][i])))
-                    x++;
-
-                x++;
-            }
+            x += utf8_width(&text[i], l->len - i);
+            for (size_t k = utf8_char_size(&text[i], l->len - i); k > 0; k--)
+                term_putchar(text[i++]);
         }
     }
 
 
-    printf("%*s\n", buffer_width - (2 + buffer->linenr_width + x) % buffer_width, "");
+    term_printf("%*s\n", buffer_width - (2 + buffer->linenr_width + x) % buffer_width, "");
+}
+
+
+// Moves the first line on screen so that the lines up to the cursor fit on the
+// screen (without redrawing)
+static void scroll_to_cursor(void)
+{
+    int top = top_line_for(active_buffer->y);
+
+    if (top > active_buffer->ys)
+        active_buffer->ys = top;
 }
 
 
@@ -384,19 +438,12 @@ void write_string(const char *s)
 
     if (!old_modified || (old_lc != active_buffer->line_count) || (old_slr != new_slr))
     {
+        scroll_to_cursor();
         full_redraw();
-
-        while (active_buffer->y > active_buffer->ye)
-        {
-            int screen_lines_required = new_slr - active_buffer->oll_unused_lines;
-            while (screen_lines_required > 0)
-                screen_lines_required -= slr(active_buffer, active_buffer->ys++);
-            full_redraw();
-        }
     }
     else
     {
-        term_cursor_pos(0, active_buffer->line_screen_pos[active_buffer->y]);
+        term_cursor_pos(0, active_buffer->line_screen_pos[active_buffer->y - active_buffer->ys]);
         draw_line(active_buffer, active_buffer->y);
     }
 
@@ -422,7 +469,7 @@ void delete_chars(int count)
         full_redraw();
     else
     {
-        term_cursor_pos(0, active_buffer->line_screen_pos[active_buffer->y]);
+        term_cursor_pos(0, active_buffer->line_screen_pos[active_buffer->y - active_buffer->ys]);
         draw_line(active_buffer, active_buffer->y);
     }
 
@@ -441,6 +488,7 @@ void scroll(int lines)
     else if (lines > 0)
     {
         active_buffer->ys += lines;
+        buffer_await_lines(active_buffer, active_buffer->ys + 1);
         if (active_buffer->ys >= active_buffer->line_count)
             active_buffer->ys = active_buffer->line_count - 1;
     }
@@ -449,13 +497,54 @@ void scroll(int lines)
 }
 
 
+void scroll_rows(int rows)
+{
+    const rope_t *lines = &active_buffer->lines;
+
+    int row = rope_row_offset(lines, active_buffer->ys) + rows;
+
+    if (rows > 0)
+    {
+        // The line containing the target row starts at or before it, so
+        // nothing is skipped (unless that line is the current first one, which
+        // is too long for the screen then)
+        int first_row, line;
+        while (((line = rope_line_at_row(lines, row, &first_row)) < 0) && (active_buffer->loader != NULL))
+            buffer_await_lines(active_buffer, active_buffer->line_count + 1);
+
+        if (line < 0)
+            line = active_buffer->line_count - 1;
+        else if ((line == active_buffer->ys) && (line < active_buffer->line_count - 1))
+            line++;
+
+        active_buffer->ys = line;
+    }
+    else if (rows < 0)
+    {
+        // Do not scroll more than requested, so go to the line behind the one
+        // containing the target row if that line starts before it (unless
+        // that means not scrolling at all)
+        int first_row, line = (row > 0) ? rope_line_at_row(lines, row, &first_row) : 0;
+
+        if ((row > 0) && (first_row < row) && (line + 1 < active_buffer->ys))
+            line++;
+
+        active_buffer->ys = line;
+    }
+
+    full_redraw();
+}
+
+
 static int current_command[64], cci;
+// Where current_command is in the key sequence trie (-1 if nowhere)
+static int current_command_node;
 
 static void print_current_command(bool completed)
 {
     term_cursor_pos(0, term_height - 1);
     syntax_region(SYNREG_DEFAULT);
-    printf("%*c", term_width - 1, ' ');
+    term_printf("%*c", term_width - 1, ' ');
     term_cursor_pos(0, term_height - 1);
 
     syntax_region(completed ? SYNREG_NORMAL_COMMAND_COMPLETED : SYNREG_NORMAL_COMMAND_TYPING);
@@ -463,10 +552,10 @@ static void print_current_command(bool completed)
     for (int i = 0; i < cci; i++)
     {
         if ((current_command[i] < 0x100) && (current_command[i] != KEY_BACKSPACE))
-            putchar(current_command[i]);
+            term_putchar(current_command[i]);
         else
         {
-            putchar('<');
+            term_putchar('<');
 
             int c = current_command[i];
 
@@ -480,7 +569,7 @@ static void print_current_command(bool completed)
             c &= ~(KEY_CONTROL | KEY_ALT | KEY_NSHIFT);
 
             if ((c < 0x100) && (c != KEY_BACKSPACE))
-                putchar(c);
+                term_putchar(c);
             else
             {
                 switch (c)
@@ -501,13 +590,13 @@ static void print_current_command(bool completed)
                     case KEY_BACKSPACE:  print("BS");     break;
                     default:
                         if ((c >= KEY_F1) && (c <= KEY_F12))
-                            printf("F%i", c - KEY_F1 + 1);
+                            term_printf("F%i", c - KEY_F1 + 1);
                         else
                             print("?");
                 }
             }
 
-            putchar('>');
+            term_putchar('>');
         }
     }
 
@@ -517,22 +606,143 @@ static void print_current_command(bool completed)
 static void clear_current_command(void)
 {
     cci = 0;
+    current_command_node = 0;
     memset(current_command, 0, sizeof(current_command));
 }
 
 
+static void draw_status_bar(void)
+{
+    int line = active_buffer->ye + 1;
+
+    term_cursor_pos(0, term_height - 2);
+    syntax_region(SYNREG_STATUSBAR);
+
+    int location_width = term_width - 16;
+    if (active_buffer->loader != NULL)
+        location_width -= term_printf("[%i%%] ", buffer_load_progress(active_buffer));
+
+    term_printf("%-*s", location_width, active_buffer->location ? active_buffer->location : "[unsaved]");
+    int position = term_printf("%i,%i", active_buffer->y + 1, active_buffer->x + 1);
+
+    term_printf("%*c", 13 - position, ' ');
+
+    bool top = !active_buffer->ys;
+    bool bot = (line >= active_buffer->line_count - 1) && (active_buffer->loader == NULL);
+
+    if (top && bot)
+        print("All\n");
+    else if (top)
+        print("Top\n");
+    else if (bot)
+        print("Bot\n");
+    else if (active_buffer->loader != NULL)
+    {
+        // The total line count is not known yet, but the file size is
+        term_printf("%2i%%\n", (int)(rope_byte_offset(&active_buffer->lines, active_buffer->ys) * 100 / active_buffer->content_size));
+    }
+    else
+    {
+        // Rows above the screen relative to all rows not on it
+        int above = rope_row_offset(&active_buffer->lines, active_buffer->ys);
+        int below = rope_row_count(&active_buffer->lines) - rope_row_offset(&active_buffer->lines, line);
+
+        term_printf("%2i%%\n", (int)(above * 100LL / (above + below)));
+    }
+}
+
+
+static void update_loading_progress(void)
+{
+    int old_linenr_width = active_buffer->linenr_width;
+
+    if (!buffer_update_loading(active_buffer))
+        return;
+
+    // Wider line numbers shift everything
+    if (active_buffer->linenr_width != old_linenr_width)
+        full_redraw();
+    else
+        draw_status_bar();
+
+    reposition_cursor(false);
+}
+
+
+static bool terminal_resized(const event_t *event, void *info)
+{
+    (void)event;
+    (void)info;
+
+    for (buffer_list_t *bl = buffer_list; bl != NULL; bl = bl->next)
+        buffer_update_screen_size(bl->buffer);
+
+    full_redraw();
+    ensure_cursor_visibility();
+    reposition_cursor(false);
+
+    return true;
+}
+
+
 void editor(void)
 {
+    register_event_handler((event_t){ EVENT_TERM_RESIZE }, terminal_resized, NULL);
+
     full_redraw();
+    term_flush();
+
+    startup_phase("editor: first screen");
+    startup_report_close();
+
+    int64_t frame_time = get_time_ms();
+    int progress_timer = -1;
 
 
     for (;;)
     {
+        if (buffer_check_truncation(active_buffer))
+            error("“%s” has been truncated by another program; its lost part reads as zero bytes.", active_buffer->location);
+
+        // Only show what all input that has arrived so far results in, so
+        // e.g. pasted text or held keys do not cause a frame each (but do not
+        // hold the screen back for too long)
+        if (!input_wait(0) || (get_time_ms() - frame_time >= MAX_FRAME_DELAY))
+        {
+            term_flush();
+            frame_time = get_time_ms();
+        }
+
+        // Keep the status bar up to date while the file is indexed
+        if ((active_buffer->loader != NULL) && (progress_timer < 0))
+            progress_timer = input_add_timer(LOAD_PROGRESS_INTERVAL, NULL, NULL);
+        else if ((active_buffer->loader == NULL) && (progress_timer >= 0))
+        {
+            input_remove_timer(progress_timer);
+            progress_timer = -1;
+        }
+
+        // Show whatever happens while waiting for input (timers, background
+        // work finishing, the terminal being resized)
+        while (!input_wait(-1))
+        {
+            update_loading_progress();
+            term_flush();
+        }
+
         int inp = input_read();
 
         if (!inp)
             continue;
 
+        if (inp == KEY_PASTE)
+        {
+            // Insert pasted text at once, even in normal mode (where typing it
+            // would execute it)
+            write_string(input_pasted_text());
+            continue;
+        }
+
 
         switch (input_mode)
         {
@@ -551,14 +761,25 @@ void editor(void)
                 else
                 {
                     current_command[cci++] = inp;
-                    print_current_command(false);
+                    current_command_node = key_seq_step(current_command_node, inp);
 
-                    if (trigger_event((event_t){ EVENT_NORMAL_KEY_SEQ, .key_seq = current_command }))
+                    if (trigger_key_seq(current_command_node, (event_t){ EVENT_NORMAL_KEY_SEQ, .key_seq = current_command }))
                     {
                         print_current_command(true);
                         clear_current_command();
                         continue;
                     }
+
+                    // Nothing can come of this sequence anymore (single keys
+                    // may still be built-in commands, though)
+                    if (!key_seq_is_prefix(current_command_node) && (cci > 1))
+                    {
+                        clear_current_command();
+                        print_current_command(false);
+                        continue;
+                    }
+
+                    print_current_command(false);
                 }
 
                 break;
@@ -581,7 +802,7 @@ void editor(void)
 
                     case 'a':
                         // Advancing is always possible, except for when the line is empty
-                        if (active_buffer->lines[active_buffer->y][0])
+                        if (buffer_line(active_buffer, active_buffer->y)->len)
                             active_buffer->x++;
                     case 'i':
                         clear_current_command();
@@ -598,7 +819,7 @@ void editor(void)
         else if (inp == '\033')
         {
             term_cursor_pos(0, term_height - 1);
-            printf("%-*c", term_width - 2, ' ');
+            term_printf("%-*c", term_width - 2, ' ');
 
             if ((input_mode == MODE_INSERT) && (active_buffer->x > 0))
                 active_buffer->x--;
@@ -638,20 +859,19 @@ void editor(void)
                     break;
 
                 case KEY_NSHIFT | KEY_RIGHT:
-                    if (active_buffer->x < (int)utf8_strlen(active_buffer->lines[active_buffer->y]) - (input_mode != MODE_INSERT))
+                    if (active_buffer->x < buffer_line(active_buffer, active_buffer->y)->chars - (input_mode != MODE_INSERT))
                         active_buffer->x++;
                     reposition_cursor(true);
                     ensure_cursor_visibility();
                     break;
 
                 case KEY_NSHIFT | KEY_DOWN:
+                    buffer_await_lines(active_buffer, active_buffer->y + 2);
                     if (active_buffer->y < active_buffer->line_count - 1)
                         active_buffer->y++;
                     if (active_buffer->y > active_buffer->ye)
                     {
-                        int screen_lines_required = slr(active_buffer, active_buffer->y) - active_buffer->oll_unused_lines;
-                        while (screen_lines_required > 0)
-                            screen_lines_required -= slr(active_buffer, active_buffer->ys++);
+                        active_buffer->ys = top_line_for(active_buffer->y);
                         full_redraw();
                     }
                     line_change_update_x();
@@ -699,6 +919,12 @@ void editor(void)
                 print_current_command(true);
                 clear_current_command();
             }
+            else if (!key_seq_is_prefix(current_command_node))
+            {
+                // Neither built in nor the beginning of a mapped sequence
+                clear_current_command();
+                print_current_command(false);
+            }
         }
     }
 }
@@ -706,26 +932,43 @@ void editor(void)
 
 void full_redraw(void)
 {
+    // Everything that fits on the screen has to be indexed
+    buffer_await_lines(active_buffer, active_buffer->ys + term_height);
+
+    // If the text has just been scrolled, most of it can be moved by the
+    // terminal instead of being printed again
+    static buffer_t *drawn_buffer;
+    static int drawn_top_row, drawn_linenr_width;
+
+    int top_row = rope_row_offset(&active_buffer->lines, active_buffer->ys);
+
+    if ((drawn_buffer == active_buffer) && (drawn_linenr_width == active_buffer->linenr_width) && (drawn_top_row != top_row))
+        term_scroll(1, buffer_height, top_row - drawn_top_row);
+
+    drawn_buffer = active_buffer;
+    drawn_top_row = top_row;
+    drawn_linenr_width = active_buffer->linenr_width;
+
     term_clear();
 
 
     int position = 1;
     syntax_region(SYNREG_TABBAR);
-    putchar(' ');
+    term_putchar(' ');
 
     for (buffer_list_t *bl = buffer_list; bl != NULL; bl = bl->next)
     {
         buffer_t *buf = bl->buffer;
 
         syntax_region((buf == active_buffer) ? SYNREG_TAB_ACTIVE_OUTER : SYNREG_TAB_INACTIVE_OUTER);
-        putchar('/');
+        term_putchar('/');
         syntax_region((buf == active_buffer) ? SYNREG_TAB_ACTIVE_INNER : SYNREG_TAB_INACTIVE_INNER);
-        printf(" %s%s ", buf->modified ? "*" : "", buf->name);
+        term_printf(" %s%s ", buf->modified ? "*" : "", buf->name);
         syntax_region((buf == active_buffer) ? SYNREG_TAB_ACTIVE_OUTER : SYNREG_TAB_INACTIVE_OUTER);
-        putchar('\\');
+        term_putchar('\\');
 
         syntax_region(SYNREG_TABBAR);
-        putchar(' ');
+        term_putchar(' ');
 
         position += 2 + buf->modified + utf8_strlen(buf->name) + 3;
     }
@@ -733,7 +976,7 @@ void full_redraw(void)
 
     int remaining = (16 * term_width - position) % term_width; // FIXME
 
-    printf("%*s\n", remaining, "");
+    term_printf("%*s\n", remaining, "");
 
 
     int y_pos = 1, line;
@@ -747,55 +990,36 @@ void full_redraw(void)
 
         draw_line(active_buffer, line);
 
-        active_buffer->line_screen_pos[line] = y_pos;
+        active_buffer->line_screen_pos[line - active_buffer->ys] = y_pos;
 
         y_pos = new_y_pos;
     }
 
     if (line < active_buffer->line_count)
     {
-        active_buffer->oll_unused_lines = term_height - 2 - y_pos;
         while (y_pos++ < term_height - 2)
         {
             syntax_region(SYNREG_LINENR);
-            printf(" %*i ", active_buffer->linenr_width,line);
+            term_printf(" %*i ", active_buffer->linenr_width,line);
             syntax_region(SYNREG_PLACEHOLDER_LINE);
-            puts("@");
+            print("@\n");
         }
     }
     else
     {
-        active_buffer->oll_unused_lines = 0;
         while (y_pos++ < term_height - 2)
         {
             syntax_region(SYNREG_LINENR);
-            printf(" %*s ", active_buffer->linenr_width, "-");
+            term_printf(" %*s ", active_buffer->linenr_width, "-");
             syntax_region(SYNREG_PLACEHOLDER_EMPTY);
-            puts("~");
+            print("~\n");
         }
     }
 
     active_buffer->ye = line - 1;
 
 
-    syntax_region(SYNREG_STATUSBAR);
-
-    printf("%-*s", term_width - 16, active_buffer->location ? active_buffer->location : "[unsaved]");
-    position = printf("%i,%i", active_buffer->y + 1, active_buffer->x + 1);
-
-    printf("%*c", 13 - position, ' ');
-
-    bool top = !active_buffer->ys;
-    bool bot = (line >= active_buffer->line_count - 1);
-
-    if (top && bot)
-        puts("All");
-    else if (top)
-        puts("Top");
-    else if (bot)
-        puts("Bot");
-    else
-        printf("%2i%%\n", (active_buffer->ys * 100) / (active_buffer->line_count - line + active_buffer->ys));
+    draw_status_bar();
 
 
     if (input_mode != MODE_NORMAL)
@@ -15,65 +15,141 @@ static struct event_handler_list
 } *event_handlers[1 << EVENT_HASH_BITS];
 
 
+// Normal mode key sequences are kept in a trie (node 0 being the root, i.e.
+// the empty sequence), so they can be matched key by key
+static struct key_seq_node
+{
+    int first_child, next_sibling;
+    int key;
+    // Only valid if handler.handler is not NULL
+    event_handler_t handler;
+} *key_seq_nodes;
+
+static int key_seq_node_count, key_seq_node_capacity;
+
+
 static int hash_event(const event_t *event)
 {
-    if (event->type != EVENT_NORMAL_KEY_SEQ)
-        return (event->type + event->code) & ((1 << EVENT_HASH_BITS) - 1);
-    else
-    {
-        int sum = event->type;
-        for (int i = 0; event->key_seq[i]; i++)
-            sum += event->key_seq[i];
-        return sum & ((1 << EVENT_HASH_BITS) - 1);
-    }
+    return (event->type + event->code) & ((1 << EVENT_HASH_BITS) - 1);
 }
 
 
-static bool key_seq_cmp(const int *ks1, const int *ks2)
+int key_seq_step(int node, int key)
 {
-    for (int i = 0; ks1[i] || ks2[i]; i++)
-        if (ks1[i] != ks2[i])
-            return false;
+    if ((node < 0) || (node >= key_seq_node_count))
+        return -1;
 
-    return true;
+    for (int child = key_seq_nodes[node].first_child; child >= 0; child = key_seq_nodes[child].next_sibling)
+        if (key_seq_nodes[child].key == key)
+            return child;
+
+    return -1;
 }
 
 
-bool trigger_event(event_t event)
+bool key_seq_is_prefix(int node)
 {
-    int hash = hash_event(&event);
+    return (node >= 0) && (node < key_seq_node_count) && (key_seq_nodes[node].first_child >= 0);
+}
 
-    if (event.type == EVENT_NORMAL_KEY_SEQ)
+
+bool trigger_key_seq(int node, event_t event)
+{
+    if ((node <= 0) || (node >= key_seq_node_count) || (key_seq_nodes[node].handler.handler == NULL))
+        return false;
+
+    return key_seq_nodes[node].handler.handler(&event, key_seq_nodes[node].handler.info);
+}
+
+
+static int key_seq_insert(const int *key_seq)
+{
+    if (!key_seq_node_count)
     {
-        // The if statement has to check the type first, since key_seq_cmp will dereference an otherwise invalid pointer
-        for (struct event_handler_list *ehl = event_handlers[hash]; ehl != NULL; ehl = ehl->next)
-            if ((ehl->handler.event.type == EVENT_NORMAL_KEY_SEQ) && key_seq_cmp(ehl->handler.event.key_seq, event.key_seq))
-                return ehl->handler.handler(&event, ehl->handler.info);
+        key_seq_node_capacity = 64;
+        key_seq_nodes = malloc(key_seq_node_capacity * sizeof(key_seq_nodes[0]));
+        key_seq_nodes[key_seq_node_count++] = (struct key_seq_node){ .first_child = -1, .next_sibling = -1 };
+    }
+
+    int node = 0;
+
+    for (int i = 0; key_seq[i]; i++)
+    {
+        int child = key_seq_step(node, key_seq[i]);
+
+        if (child < 0)
+        {
+            if (key_seq_node_count >= key_seq_node_capacity)
+                key_seq_nodes = realloc(key_seq_nodes, (key_seq_node_capacity *= 2) * sizeof(key_seq_nodes[0]));
+
+            child = key_seq_node_count++;
+            key_seq_nodes[child] = (struct key_seq_node){
+                .first_child = -1,
+                .next_sibling = key_seq_nodes[node].first_child,
+                .key = key_seq[i]
+            };
+            key_seq_nodes[node].first_child = child;
+        }
+
+        node = child;
     }
-    else
+
+    return node;
+}
+
+
+bool trigger_event(event_t event)
+{
+    if (event.type == EVENT_NORMAL_KEY_SEQ)
     {
-        for (struct event_handler_list *ehl = event_handlers[hash]; ehl != NULL; ehl = ehl->next)
-            if ((ehl->handler.event.code == event.code) && (ehl->handler.event.type == event.type))
-                return ehl->handler.handler(&event, ehl->handler.info);
+        int node = 0;
+        for (int i = 0; event.key_seq[i] && (node >= 0); i++)
+            node = key_seq_step(node, event.key_seq[i]);
+
+        return trigger_key_seq(node, event);
     }
 
+
+    int hash = hash_event(&event);
+
+    for (struct event_handler_list *ehl = event_handlers[hash]; ehl != NULL; ehl = ehl->next)
+        if ((ehl->handler.event.code == event.code) && (ehl->handler.event.type == event.type))
+            return ehl->handler.handler(&event, ehl->handler.info);
+
     return false;
 }
 
 
 void register_event_handler(event_t event, bool (*handler)(const event_t *event, void *info), void *info)
 {
+    if (event.type == EVENT_NORMAL_KEY_SEQ)
+    {
+        int node = key_seq_insert(event.key_seq);
+
+        // The empty sequence cannot be mapped
+        if (!node)
+        {
+            free((void *)event.key_seq);
+            return;
+        }
+
+        if (key_seq_nodes[node].handler.handler != NULL)
+            free((void *)event.key_seq);
+        else
+            key_seq_nodes[node].handler.event = event;
+
+        key_seq_nodes[node].handler.handler = handler;
+        key_seq_nodes[node].handler.info = info;
+        return;
+    }
+
+
     int hash = hash_event(&event);
 
     for (struct event_handler_list *ehl = event_handlers[hash]; ehl != NULL; ehl = ehl->next)
     {
-        if ((ehl->handler.event.type == event.type) &&
-           (((event.type == EVENT_NORMAL_KEY_SEQ) && key_seq_cmp(ehl->handler.event.key_seq, event.key_seq)) ||
-            ((event.type != EVENT_NORMAL_KEY_SEQ) && (ehl->handler.event.code == event.code))))
+        if ((ehl->handler.event.type == event.type) && (ehl->handler.event.code == event.code))
         {
-            if (event.type == EVENT_NORMAL_KEY_SEQ)
-                free((void *)event.key_seq);
-
             ehl->handler.handler = handler;
             ehl->handler.info = info;
             return;
@@ -1,139 +1,375 @@
-#include <fcntl.h>
-#include <regex.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "events.h"
 #include "input.h"
 #include "keycodes.h"
 
 
-#define ESEQ_HASH_BITS 8
+// Time to wait for the rest of an escape sequence (in ms); if nothing follows
+// an escape byte within that time, the user has hit the escape key
+#define ESCAPE_TIMEOUT 25
 
 
-static struct eseq_trans_list
+// Trie of the known escape sequences, node 0 being the root
+static struct eseq_node
 {
-    struct eseq_trans_list *next;
-    const char *sequence;
+    int first_child, next_sibling;
     int keycode;
-} *eseq_trans_list[1 << ESEQ_HASH_BITS];
+    unsigned char byte;
+} *eseq_nodes;
 
+static int eseq_node_count, eseq_node_capacity;
 
-static size_t fifo_size, fifo_content;
+
+// Simulated input (ring buffer, its size being a power of two)
+static size_t fifo_size, fifo_head, fifo_content;
 static int *fifo;
 
-static regex_t mouse_input_regex_1006, mouse_input_regex_1015;
+// Input that has been read from the terminal, but not processed yet
+static unsigned char in_buf[65536];
+static size_t in_pos, in_len;
+
+// What input_wait() watches besides the keyboard
+static struct input_source
+{
+    int fd;
+    // Timers have to be read before the handler is called
+    bool timer;
+    void (*handler)(void *info);
+    void *info;
+} *sources;
+
+static int source_count, source_capacity;
 
+// Written to by other threads to interrupt input_wait()
+static int notify_fd = -1;
 
-void init_mouse_input_regex(void)
+// Text of the last bracketed paste
+static char *paste;
+static size_t paste_len, paste_size;
+
+
+// Reads more input into the buffer, waiting at most "timeout" milliseconds
+// (forever if negative); returns false if nothing could be read
+static bool fill_input(int timeout)
 {
-    regcomp(&mouse_input_regex_1006, "^\033\\[<\\([0-9]\\+\\);\\([0-9]\\+\\);\\([0-9]\\+\\)\\([mM]\\)$", 0);
-    regcomp(&mouse_input_regex_1015, "^\033\\[\\([0-9]\\+\\);\\([0-9]\\+\\);\\([0-9]\\+\\)M$", 0);
+    if (in_pos == in_len)
+        in_pos = in_len = 0;
+    else if (in_len == sizeof(in_buf))
+    {
+        memmove(in_buf, in_buf + in_pos, in_len - in_pos);
+        in_len -= in_pos;
+        in_pos = 0;
+    }
+
+    if (timeout >= 0)
+    {
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) <= 0)
+            return false;
+    }
+
+    ssize_t ret;
+    do
+        ret = read(STDIN_FILENO, in_buf + in_len, sizeof(in_buf) - in_len);
+    while ((ret < 0) && (errno == EINTR));
+
+    if (ret <= 0)
+        return false;
+
+    in_len += ret;
+    return true;
+}
+
+
+// Returns the byte at "offset" from the current position without consuming
+// it, or -1 if it does not arrive within "timeout" milliseconds
+static int peek_input(size_t offset, int timeout)
+{
+    while (in_len - in_pos <= offset)
+        if (!fill_input(timeout))
+            return -1;
+
+    return in_buf[in_pos + offset];
 }
 
 
-static int hash_eseq(const char *sequence)
+static void append_paste(const unsigned char *text, size_t len)
 {
-    uint32_t hash = 5381;
-    uint8_t c;
+    if (paste_len + len + 1 > paste_size)
+    {
+        paste_size = paste_size ? paste_size : 4096;
+        while (paste_len + len + 1 > paste_size)
+            paste_size *= 2;
 
-    while ((c = *(sequence++)))
-        hash = ((hash << 5) + hash) ^ c;
+        paste = realloc(paste, paste_size);
+    }
 
-    return hash & ((1 << ESEQ_HASH_BITS) - 1);
+    memcpy(paste + paste_len, text, len);
+    paste_len += len;
 }
 
 
-static int read_escape_sequence(void)
+// Reads pasted text up to the end marker (the start marker has been consumed
+// already)
+static int read_paste(void)
 {
-    fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
-    char escape_sequence[32] = { '\033' };
-    int eseq_len = fread(&escape_sequence[1], 1, 30, stdin);
-    fcntl(STDIN_FILENO, F_SETFL, 0);
+    static const char end_marker[] = "\033[201~";
+    const size_t marker_len = sizeof(end_marker) - 1;
 
-    if (eseq_len <= 0)
-        return '\033';
+    paste_len = 0;
 
-    int hash = hash_eseq(escape_sequence);
+    // There has to be a buffer to terminate even if input ends right after
+    // the start marker
+    if (paste == NULL)
+        paste = malloc(paste_size = 4096);
 
-    for (struct eseq_trans_list *etl = eseq_trans_list[hash]; etl != NULL; etl = etl->next)
-        if (!strcmp(etl->sequence, escape_sequence))
-            return etl->keycode;
+    char *end = NULL;
+    size_t searched = 0;
 
+    // Take whole blocks, so huge pastes do not take a syscall per byte
+    while ((in_pos < in_len) || fill_input(-1))
+    {
+        searched = (paste_len > marker_len) ? (paste_len - marker_len + 1) : 0;
+        append_paste(in_buf + in_pos, in_len - in_pos);
+        in_pos = in_len;
 
-    int match_type;
+        end = memmem(paste + searched, paste_len - searched, end_marker, marker_len);
+        if (end != NULL)
+            break;
+    }
 
-    regmatch_t matches[5];
-    if (!regexec(&mouse_input_regex_1006, escape_sequence, 5, matches, 0))
-        match_type = 1006;
-    else if (!regexec(&mouse_input_regex_1015, escape_sequence, 4, matches, 0))
-        match_type = 1015;
-    else if ((escape_sequence[1] == '[') && (escape_sequence[2] == 'M'))
-        match_type = 1000;
-    else
-        return 0;
+    if (end != NULL)
+    {
+        // The marker has only been completed by the last block, so whatever
+        // has been typed after the paste is still in the input buffer
+        in_pos -= paste + paste_len - (end + marker_len);
+        paste_len = end - paste;
+    }
 
+    paste[paste_len] = 0;
 
-    int button = (match_type == 1000) ? escape_sequence[3] : atoi(&escape_sequence[matches[1].rm_so]);
-    int x      = (match_type == 1000) ? escape_sequence[4] : atoi(&escape_sequence[matches[2].rm_so]);
-    int y      = (match_type == 1000) ? escape_sequence[5] : atoi(&escape_sequence[matches[3].rm_so]);
+    return KEY_PASTE;
+}
 
-    int event_type = EVENT_MBUTTON_DOWN;
 
-    if (match_type == 1006)
-        event_type = (escape_sequence[matches[4].rm_so] == 'M') ? EVENT_MBUTTON_DOWN : EVENT_MBUTTON_UP;
-    else if ((match_type == 1015) || (match_type == 1000))
+static int eseq_find_child(int node, unsigned char byte)
+{
+    for (int child = eseq_nodes[node].first_child; child >= 0; child = eseq_nodes[child].next_sibling)
+        if (eseq_nodes[child].byte == byte)
+            return child;
+
+    return -1;
+}
+
+
+// Looks for the longest known escape sequence at the start of the input;
+// returns its keycode (0 if there is none) and stores its length in *length
+static int match_eseq(size_t *length)
+{
+    int node = 0, keycode = 0;
+
+    *length = 0;
+
+    if (!eseq_node_count)
+        return 0;
+
+    for (size_t i = 0; eseq_nodes[node].first_child >= 0; i++)
     {
-        button -= ' ';
+        int c = peek_input(i, ESCAPE_TIMEOUT);
+        if (c < 0)
+            break;
+
+        node = eseq_find_child(node, c);
+        if (node < 0)
+            break;
 
-        if (match_type == 1000)
+        if (eseq_nodes[node].keycode)
         {
-            x -= ' ';
-            y -= ' ';
+            keycode = eseq_nodes[node].keycode;
+            *length = i + 1;
         }
+    }
+
+    return keycode;
+}
+
+
+// Reports of the older mouse protocols only tell that some button has been
+// released, so remember which one it was
+static void legacy_mouse_event(int button, int x, int y)
+{
+    static int last_down = 0;
+
+    int event_type = EVENT_MBUTTON_DOWN;
+
+    button -= ' ';
 
-        static int last_down = 0;
+    if (button < 3)
+        last_down = button;
+    else if (button == 3)
+    {
+        button = last_down;
+        event_type = EVENT_MBUTTON_UP;
+    }
+
+    trigger_event((event_t){ event_type, .code = button, .mbutton = { x - 1, y - 1 } });
+}
 
-        if (button < 3)
-            last_down = button;
-        else if (button == 3)
+
+// Decodes a control sequence introduced by ESC [ (which is followed by
+// parameter bytes, intermediate bytes and a final byte)
+static int read_csi(void)
+{
+    size_t i = 2;
+    int c = peek_input(i, ESCAPE_TIMEOUT);
+
+    // X10 style mouse report, with three raw bytes following
+    if (c == 'M')
+    {
+        int button = peek_input(3, ESCAPE_TIMEOUT);
+        int x = peek_input(4, ESCAPE_TIMEOUT);
+        int y = peek_input(5, ESCAPE_TIMEOUT);
+
+        if (y < 0)
         {
-            button = last_down;
-            event_type = EVENT_MBUTTON_UP;
+            in_pos = in_len;
+            return 0;
         }
+
+        in_pos += 6;
+        legacy_mouse_event(button, x - ' ', y - ' ');
+        return 0;
     }
 
+    int private = 0, param_count = 0;
+    int params[3] = { 0 };
 
-    trigger_event((event_t){ event_type, .code = button, .mbutton = { x - 1, y - 1 } });
+    if ((c >= '<') && (c <= '?'))
+    {
+        private = c;
+        c = peek_input(++i, ESCAPE_TIMEOUT);
+    }
+
+    for (; (c >= 0x30) && (c <= 0x3f); c = peek_input(++i, ESCAPE_TIMEOUT))
+    {
+        if (!param_count)
+            param_count = 1;
+
+        if (c == ';')
+            param_count++;
+        else if ((c >= '0') && (c <= '9') && (param_count <= 3))
+            params[param_count - 1] = params[param_count - 1] * 10 + c - '0';
+    }
+
+    while ((c >= 0x20) && (c <= 0x2f))
+        c = peek_input(++i, ESCAPE_TIMEOUT);
+
+    if ((c < 0x40) || (c > 0x7e))
+    {
+        // Broken sequence; drop it, but not what follows it
+        in_pos += i;
+        return 0;
+    }
+
+    in_pos += i + 1;
+
+    if (!private && (c == '~') && (param_count == 1) && (params[0] == 200))
+        return read_paste();
+
+    if ((private == '<') && ((c == 'M') || (c == 'm')) && (param_count == 3))
+    {
+        int type = (c == 'M') ? EVENT_MBUTTON_DOWN : EVENT_MBUTTON_UP;
+        trigger_event((event_t){ type, .code = params[0], .mbutton = { params[1] - 1, params[2] - 1 } });
+    }
+    else if (!private && (c == 'M') && (param_count == 3))
+        legacy_mouse_event(params[0], params[1], params[2]);
 
     return 0;
 }
 
 
+static int read_escape_sequence(void)
+{
+    int c = peek_input(1, ESCAPE_TIMEOUT);
+
+    if (c < 0)
+    {
+        // Just the escape key
+        in_pos++;
+        return '\033';
+    }
+
+    size_t length;
+    int keycode = match_eseq(&length);
+
+    if (keycode)
+    {
+        in_pos += length;
+        return keycode;
+    }
+
+    if (c == '[')
+        return read_csi();
+
+    if ((c == 'O') && (peek_input(2, ESCAPE_TIMEOUT) >= 0))
+    {
+        // Unknown SS3 sequence
+        in_pos += 3;
+        return 0;
+    }
+
+    // Escape key followed by something else, which is handled on its own
+    in_pos++;
+    return '\033';
+}
+
+
 void add_input_escape_sequence(char *sequence, int keycode)
 {
-    int hash = hash_eseq(sequence);
-    struct eseq_trans_list **etlp;
+    if (!eseq_node_count)
+    {
+        eseq_node_capacity = 64;
+        eseq_nodes = malloc(eseq_node_capacity * sizeof(eseq_nodes[0]));
+        eseq_nodes[eseq_node_count++] = (struct eseq_node){ .first_child = -1, .next_sibling = -1 };
+    }
+
+    int node = 0;
 
-    for (etlp = &eseq_trans_list[hash]; *etlp != NULL; etlp = &(*etlp)->next)
+    for (const unsigned char *c = (const unsigned char *)sequence; *c; c++)
     {
-        if (!strcmp((*etlp)->sequence, sequence))
+        int child = eseq_find_child(node, *c);
+
+        if (child < 0)
         {
-            free(sequence);
-            (*etlp)->keycode = keycode;
-            return;
+            if (eseq_node_count >= eseq_node_capacity)
+                eseq_nodes = realloc(eseq_nodes, (eseq_node_capacity *= 2) * sizeof(eseq_nodes[0]));
+
+            child = eseq_node_count++;
+            eseq_nodes[child] = (struct eseq_node){
+                .first_child = -1,
+                .next_sibling = eseq_nodes[node].first_child,
+                .byte = *c
+            };
+            eseq_nodes[node].first_child = child;
         }
+
+        node = child;
     }
 
-    struct eseq_trans_list *etl = malloc(sizeof(*etl));
-    etl->next = NULL;
-    etl->sequence = sequence;
-    etl->keycode = keycode;
+    if (node)
+        eseq_nodes[node].keycode = keycode;
 
-    *etlp = etl;
+    free(sequence);
 }
 
 
@@ -141,31 +377,221 @@ int input_read(void)
 {
     if (fifo_content)
     {
-        int v = fifo[0];
+        int v = fifo[fifo_head];
 
-        if (--fifo_content)
-            memmove(&fifo[0], &fifo[1], fifo_content * sizeof(fifo[0]));
+        fifo_head = (fifo_head + 1) & (fifo_size - 1);
+        fifo_content--;
 
         return v;
     }
 
 
-    int inp = getchar();
+    int inp = peek_input(0, -1);
 
     if (inp == '\e')
         inp = read_escape_sequence();
-    else if ((inp >= 1) && (inp <= 26) && (inp != '\n'))
-        inp = (inp + 96) | KEY_CONTROL;
+    else
+    {
+        if (inp >= 0)
+            in_pos++;
+
+        if ((inp >= 1) && (inp <= 26) && (inp != '\n'))
+            inp = (inp + 96) | KEY_CONTROL;
+    }
 
 
     return inp;
 }
 
 
+void input_init(void)
+{
+    notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+
+void input_notify(void)
+{
+    uint64_t one = 1;
+
+    if (notify_fd >= 0)
+        write(notify_fd, &one, sizeof(one));
+}
+
+
+void input_watch_fd(int fd, void (*handler)(void *info), void *info)
+{
+    if (source_count >= source_capacity)
+    {
+        source_capacity = source_capacity ? source_capacity * 2 : 8;
+        sources = realloc(sources, source_capacity * sizeof(sources[0]));
+    }
+
+    sources[source_count++] = (struct input_source){
+        .fd = fd,
+        .timer = false,
+        .handler = handler,
+        .info = info
+    };
+}
+
+
+void input_unwatch_fd(int fd)
+{
+    for (int i = 0; i < source_count; i++)
+    {
+        if (sources[i].fd == fd)
+        {
+            memmove(&sources[i], &sources[i + 1], (source_count - i - 1) * sizeof(sources[0]));
+            source_count--;
+            return;
+        }
+    }
+}
+
+
+int input_add_timer(int interval, void (*handler)(void *info), void *info)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd < 0)
+        return -1;
+
+    struct timespec ts = { .tv_sec = interval / 1000, .tv_nsec = interval % 1000 * 1000000L };
+    struct itimerspec its = { .it_interval = ts, .it_value = ts };
+
+    if (timerfd_settime(fd, 0, &its, NULL) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    input_watch_fd(fd, handler, info);
+    sources[source_count - 1].timer = true;
+
+    return fd;
+}
+
+
+void input_remove_timer(int timer)
+{
+    input_unwatch_fd(timer);
+    close(timer);
+}
+
+
+static void dispatch_source(int fd)
+{
+    for (int i = 0; i < source_count; i++)
+    {
+        if (sources[i].fd != fd)
+            continue;
+
+        uint64_t expirations;
+        if (sources[i].timer && (read(fd, &expirations, sizeof(expirations)) < 0))
+            return;
+
+        if (sources[i].handler != NULL)
+            sources[i].handler(sources[i].info);
+
+        return;
+    }
+}
+
+
+bool input_wait(int timeout)
+{
+    if (fifo_content || (in_pos < in_len))
+        return true;
+
+    static struct pollfd *pfds;
+    static int pfd_capacity;
+
+    int pfd_count = 2 + source_count;
+    if (pfd_count > pfd_capacity)
+    {
+        pfd_capacity = pfd_count;
+        pfds = realloc(pfds, pfd_capacity * sizeof(pfds[0]));
+    }
+
+    pfds[0] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+    pfds[1] = (struct pollfd){ .fd = notify_fd, .events = POLLIN };
+    for (int i = 0; i < source_count; i++)
+        pfds[2 + i] = (struct pollfd){ .fd = sources[i].fd, .events = POLLIN };
+
+    // On error, let input_read() block
+    if (poll(pfds, pfd_count, timeout) < 0)
+        return true;
+
+    if (pfds[1].revents)
+    {
+        uint64_t count;
+        read(notify_fd, &count, sizeof(count));
+    }
+
+    // Handlers may add or remove sources, so look every one up again
+    for (int i = 2; i < pfd_count; i++)
+        if (pfds[i].revents)
+            dispatch_source(pfds[i].fd);
+
+    return pfds[0].revents != 0;
+}
+
+
+const char *input_pasted_text(void)
+{
+    return paste ? paste : "";
+}
+
+
+static void grow_fifo(size_t count)
+{
+    size_t new_size = fifo_size ? fifo_size : 16;
+    while (new_size < fifo_content + count)
+        new_size *= 2;
+
+    if (new_size == fifo_size)
+        return;
+
+    int *new_fifo = malloc(new_size * sizeof(fifo[0]));
+
+    // Unwrap the content
+    size_t first = fifo_size - fifo_head;
+    if (first > fifo_content)
+        first = fifo_content;
+
+    if (fifo_content)
+    {
+        memcpy(new_fifo, &fifo[fifo_head], first * sizeof(fifo[0]));
+        memcpy(&new_fifo[first], fifo, (fifo_content - first) * sizeof(fifo[0]));
+    }
+
+    free(fifo);
+    fifo = new_fifo;
+    fifo_size = new_size;
+    fifo_head = 0;
+}
+
+
 void sim_input(int val)
 {
-    if (fifo_content + 1 > fifo_size)
-        fifo = realloc(fifo, fifo_size + 16 * sizeof(fifo[0]));
+    sim_input_array(&val, 1);
+}
+
+
+void sim_input_array(const int *vals, size_t count)
+{
+    if (!count)
+        return;
+
+    grow_fifo(count);
+
+    size_t tail = (fifo_head + fifo_content) & (fifo_size - 1);
+    size_t first = fifo_size - tail;
+    if (first > count)
+        first = count;
+
+    memcpy(&fifo[tail], vals, first * sizeof(fifo[0]));
+    memcpy(fifo, &vals[first], (count - first) * sizeof(fifo[0]));
 
-    fifo[fifo_content++] = val;
+    fifo_content += count;
 }
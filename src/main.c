@@ -7,11 +7,13 @@
 #include "config.h"
 #include "editor.h"
 #include "term.h"
+#include "tools.h"
 
 
 static struct option long_options[] = {
     { "help", no_argument, 0, 'h' },
     { "version", no_argument, 0, 'v' },
+    { "startuptime", required_argument, 0, 's' },
     { 0, 0, 0, 0 }
 };
 
@@ -27,9 +29,10 @@ int main(int argc, char *argv[])
         switch (c)
         {
             case 'h':
-                printf("Usage: std FILE\n"
-                        "--help, -h     Show this help\n"
-                        "--version, -v  Show current version\n");
+                printf("Usage: std [OPTION]... [FILE]...\n"
+                        "--help, -h           Show this help\n"
+                        "--version, -v        Show current version\n"
+                        "--startuptime FILE   Append the time spent in each startup phase to FILE\n");
                 return 0;
 
             case 'v':
@@ -37,6 +40,14 @@ int main(int argc, char *argv[])
                        "No need for ed anymore.\n");
                 return 0;
 
+            case 's':
+                if (!startup_report_open(optarg))
+                {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+
             default:
                 return 0;
         }
@@ -48,11 +59,11 @@ int main(int argc, char *argv[])
     load_config();
 
 
-    if (argc < 2)
+    if (optind >= argc)
         new_buffer();
     else
     {
-        for (int i = 1; i < argc; i++)
+        for (int i = optind; i < argc; i++)
         {
             buffer_t *buf = new_buffer();
 
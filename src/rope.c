@@ -0,0 +1,471 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rope.h"
+
+
+static uint32_t next_priority(void)
+{
+    // Ropes may be built by several threads, so every thread gets its own
+    // generator, seeded from the location of its state
+    static _Thread_local uint32_t state;
+
+    if (!state)
+        state = (2463534242u ^ (uint32_t)((uintptr_t)&state >> 4)) | 1;
+
+    // xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+
+static inline int node_lines(const rope_node_t *node)
+{
+    return node ? node->lines : 0;
+}
+
+static inline size_t node_bytes(const rope_node_t *node)
+{
+    return node ? node->bytes : 0;
+}
+
+static inline int node_rows(const rope_node_t *node)
+{
+    return node ? node->rows : 0;
+}
+
+static inline void recalc(rope_node_t *node)
+{
+    node->lines = 1 + node_lines(node->left) + node_lines(node->right);
+    node->bytes = node->line.len + 1 + node_bytes(node->left) + node_bytes(node->right);
+    node->rows = node->line_rows + node_rows(node->left) + node_rows(node->right);
+}
+
+
+static inline int line_rows(const rope_t *rope, const line_t *line)
+{
+    if (rope->row_width <= 0)
+        return 0;
+
+    return (rope->row_prefix + line->width + rope->row_width - 1) / rope->row_width;
+}
+
+
+// Splits the tree into the first "count" lines (*left) and the rest (*right)
+static void split(rope_node_t *node, int count, rope_node_t **left, rope_node_t **right)
+{
+    if (node == NULL)
+    {
+        *left = *right = NULL;
+        return;
+    }
+
+    int left_lines = node_lines(node->left);
+
+    if (count <= left_lines)
+    {
+        split(node->left, count, left, &node->left);
+        *right = node;
+    }
+    else
+    {
+        split(node->right, count - left_lines - 1, &node->right, right);
+        *left = node;
+    }
+
+    recalc(node);
+}
+
+
+static rope_node_t *merge(rope_node_t *left, rope_node_t *right)
+{
+    if (left == NULL)
+        return right;
+    if (right == NULL)
+        return left;
+
+    if (left->priority > right->priority)
+    {
+        left->right = merge(left->right, right);
+        recalc(left);
+        return left;
+    }
+    else
+    {
+        right->left = merge(left, right->left);
+        recalc(right);
+        return right;
+    }
+}
+
+
+// Builds a treap from a line array in linear time by maintaining its right
+// spine (which is only logarithmically long on average)
+static rope_node_t *build(rope_t *rope, const line_t *lines, int count)
+{
+    int spine_size = 64, depth = 0;
+    rope_node_t **spine = malloc(spine_size * sizeof(*spine));
+
+    for (int i = 0; i < count; i++)
+    {
+        rope_node_t *node = slab_alloc(&rope->nodes);
+        node->left = node->right = NULL;
+        node->priority = next_priority();
+        node->line = lines[i];
+        node->line_rows = line_rows(rope, &node->line);
+
+        rope_node_t *last = NULL;
+        while (depth && (spine[depth - 1]->priority < node->priority))
+        {
+            last = spine[--depth];
+            recalc(last);
+        }
+
+        node->left = last;
+        if (depth)
+            spine[depth - 1]->right = node;
+
+        if (depth >= spine_size)
+            spine = realloc(spine, (spine_size *= 2) * sizeof(*spine));
+        spine[depth++] = node;
+    }
+
+    while (depth > 1)
+        recalc(spine[--depth]);
+
+    rope_node_t *root = NULL;
+    if (depth)
+    {
+        root = spine[0];
+        recalc(root);
+    }
+
+    free(spine);
+
+    return root;
+}
+
+
+static void destroy(rope_t *rope, rope_node_t *node)
+{
+    if (node == NULL)
+        return;
+
+    destroy(rope, node->left);
+    destroy(rope, node->right);
+
+    if (node->line.capacity)
+        text_heap_free(&rope->text, node->line.text, node->line.capacity);
+    if (node->line.checkpoints != NULL)
+        text_heap_free(&rope->text, (char *)node->line.checkpoints, node->line.checkpoints->size);
+    slab_free(&rope->nodes, node);
+}
+
+
+void rope_init(rope_t *rope)
+{
+    rope->root = NULL;
+    rope->row_prefix = rope->row_width = 0;
+
+    slab_init(&rope->nodes, sizeof(rope_node_t));
+    text_heap_init(&rope->text);
+}
+
+
+void rope_clear(rope_t *rope)
+{
+    // No need to visit every line
+    slab_release(&rope->nodes);
+    text_heap_release(&rope->text);
+
+    rope->root = NULL;
+}
+
+
+int rope_line_count(const rope_t *rope)
+{
+    return node_lines(rope->root);
+}
+
+
+line_t *rope_line(rope_t *rope, int index)
+{
+    rope_node_t *node = rope->root;
+
+    while (node != NULL)
+    {
+        int left_lines = node_lines(node->left);
+
+        if (index < left_lines)
+            node = node->left;
+        else if (index > left_lines)
+        {
+            index -= left_lines + 1;
+            node = node->right;
+        }
+        else
+            return &node->line;
+    }
+
+    return NULL;
+}
+
+
+static void update(const rope_t *rope, rope_node_t *node, int index)
+{
+    int left_lines = node_lines(node->left);
+
+    if (index < left_lines)
+        update(rope, node->left, index);
+    else if (index > left_lines)
+        update(rope, node->right, index - left_lines - 1);
+    else
+        node->line_rows = line_rows(rope, &node->line);
+
+    recalc(node);
+}
+
+void rope_update(rope_t *rope, int index)
+{
+    if ((index >= 0) && (index < node_lines(rope->root)))
+        update(rope, rope->root, index);
+}
+
+
+void rope_insert(rope_t *rope, int index, const line_t *lines, int count)
+{
+    rope_node_t *left, *right;
+
+    split(rope->root, index, &left, &right);
+    rope->root = merge(merge(left, build(rope, lines, count)), right);
+}
+
+
+void rope_append(rope_t *rope, rope_t *tail)
+{
+    if (rope->root == NULL)
+    {
+        rope->row_prefix = tail->row_prefix;
+        rope->row_width = tail->row_width;
+    }
+    else
+        rope_set_geometry(tail, rope->row_prefix, rope->row_width);
+
+    rope->root = merge(rope->root, tail->root);
+    tail->root = NULL;
+
+    slab_adopt(&rope->nodes, &tail->nodes);
+    text_heap_adopt(&rope->text, &tail->text);
+}
+
+
+void rope_resize_line(rope_t *rope, line_t *line, size_t capacity)
+{
+    if (line->capacity)
+    {
+        line->text = text_heap_realloc(&rope->text, line->text, line->capacity, &capacity);
+        line->capacity = capacity;
+        return;
+    }
+
+    // Copy the content out of wherever it has been pointing to
+    char *text = text_heap_realloc(&rope->text, NULL, 0, &capacity);
+
+    if (line->len >= capacity)
+        line->len = capacity - 1;
+
+    memcpy(text, line->text, line->len);
+    text[line->len] = 0;
+
+    line->text = text;
+    line->capacity = capacity;
+}
+
+
+void rope_resize_checkpoints(rope_t *rope, line_t *line, int count)
+{
+    line_checkpoints_t *cps = line->checkpoints;
+
+    if (!count)
+    {
+        if (cps != NULL)
+            text_heap_free(&rope->text, (char *)cps, cps->size);
+        line->checkpoints = NULL;
+        return;
+    }
+
+    size_t size = sizeof(*cps) + count * sizeof(cps->pos[0]);
+    if ((cps != NULL) && (cps->size >= size))
+        return;
+
+    // Checkpoints are kept with the line contents, so they are freed together
+    cps = (line_checkpoints_t *)text_heap_realloc(&rope->text, (char *)cps, (cps != NULL) ? cps->size : 0, &size);
+    if (line->checkpoints == NULL)
+        cps->count = 0;
+    cps->size = size;
+
+    line->checkpoints = cps;
+}
+
+
+void rope_remove(rope_t *rope, int index, int count)
+{
+    rope_node_t *left, *middle, *right;
+
+    split(rope->root, index, &left, &middle);
+    split(middle, count, &middle, &right);
+
+    destroy(rope, middle);
+
+    rope->root = merge(left, right);
+}
+
+
+size_t rope_byte_offset(const rope_t *rope, int index)
+{
+    size_t offset = 0;
+
+    for (const rope_node_t *node = rope->root; node != NULL;)
+    {
+        int left_lines = node_lines(node->left);
+
+        if (index < left_lines)
+            node = node->left;
+        else if (index == left_lines)
+            return offset + node_bytes(node->left);
+        else
+        {
+            offset += node_bytes(node->left) + node->line.len + 1;
+            index -= left_lines + 1;
+            node = node->right;
+        }
+    }
+
+    return offset;
+}
+
+
+int rope_line_at_byte(const rope_t *rope, size_t offset)
+{
+    int index = 0;
+
+    for (const rope_node_t *node = rope->root; node != NULL;)
+    {
+        size_t left_bytes = node_bytes(node->left);
+
+        if (offset < left_bytes)
+            node = node->left;
+        else if (offset <= left_bytes + node->line.len)
+            return index + node_lines(node->left);
+        else
+        {
+            offset -= left_bytes + node->line.len + 1;
+            index += node_lines(node->left) + 1;
+            node = node->right;
+        }
+    }
+
+    return -1;
+}
+
+
+static void recount_rows(const rope_t *rope, rope_node_t *node)
+{
+    if (node == NULL)
+        return;
+
+    recount_rows(rope, node->left);
+    recount_rows(rope, node->right);
+
+    node->line_rows = line_rows(rope, &node->line);
+    node->rows = node->line_rows + node_rows(node->left) + node_rows(node->right);
+}
+
+void rope_set_geometry(rope_t *rope, int prefix, int width)
+{
+    if ((rope->row_prefix == prefix) && (rope->row_width == width))
+        return;
+
+    rope->row_prefix = prefix;
+    rope->row_width = width;
+
+    recount_rows(rope, rope->root);
+}
+
+
+int rope_row_count(const rope_t *rope)
+{
+    return node_rows(rope->root);
+}
+
+
+int rope_row_offset(const rope_t *rope, int index)
+{
+    int offset = 0;
+
+    for (const rope_node_t *node = rope->root; node != NULL;)
+    {
+        int left_lines = node_lines(node->left);
+
+        if (index < left_lines)
+            node = node->left;
+        else if (index == left_lines)
+            return offset + node_rows(node->left);
+        else
+        {
+            offset += node_rows(node->left) + node->line_rows;
+            index -= left_lines + 1;
+            node = node->right;
+        }
+    }
+
+    return offset;
+}
+
+
+int rope_line_at_row(const rope_t *rope, int row, int *first_row)
+{
+    int index = 0, offset = 0;
+
+    for (const rope_node_t *node = rope->root; node != NULL;)
+    {
+        int left_rows = node_rows(node->left);
+
+        if (row - offset < left_rows)
+            node = node->left;
+        else if (row - offset < left_rows + node->line_rows)
+        {
+            *first_row = offset + left_rows;
+            return index + node_lines(node->left);
+        }
+        else
+        {
+            offset += left_rows + node->line_rows;
+            index += node_lines(node->left) + 1;
+            node = node->right;
+        }
+    }
+
+    return -1;
+}
+
+
+static void foreach(rope_node_t *node, void (*func)(line_t *line, void *info), void *info)
+{
+    if (node == NULL)
+        return;
+
+    foreach(node->left, func, info);
+    func(&node->line, info);
+    foreach(node->right, func, info);
+}
+
+void rope_foreach(rope_t *rope, void (*func)(line_t *line, void *info), void *info)
+{
+    foreach(rope->root, func, info);
+}
@@ -0,0 +1,255 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+
+// Objects begin behind the chunk's link, aligned like anything malloc returns
+#define CHUNK_HEADER_SIZE (sizeof(max_align_t))
+
+
+void slab_init(slab_t *slab, size_t object_size)
+{
+    if (object_size < sizeof(void *))
+        object_size = sizeof(void *);
+
+    // Keep every object aligned
+    object_size = (object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    *slab = (slab_t){ .object_size = object_size };
+}
+
+
+void *slab_alloc(slab_t *slab)
+{
+    void *object;
+
+    if (slab->free_list != NULL)
+    {
+        object = slab->free_list;
+        slab->free_list = *(void **)object;
+    }
+    else
+    {
+        if (slab->unused + slab->object_size > slab->unused_end)
+        {
+            char *chunk = malloc(SLAB_CHUNK_SIZE);
+
+            *(void **)chunk = slab->chunks;
+            slab->chunks = chunk;
+            slab->chunk_count++;
+
+            slab->unused = chunk + CHUNK_HEADER_SIZE;
+            slab->unused_end = chunk + SLAB_CHUNK_SIZE;
+        }
+
+        object = slab->unused;
+        slab->unused += slab->object_size;
+    }
+
+    slab->used_objects++;
+
+    return object;
+}
+
+
+void slab_free(slab_t *slab, void *object)
+{
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+
+    slab->used_objects--;
+}
+
+
+void slab_release(slab_t *slab)
+{
+    while (slab->chunks != NULL)
+    {
+        void *next = *(void **)slab->chunks;
+        free(slab->chunks);
+        slab->chunks = next;
+    }
+
+    slab_init(slab, slab->object_size);
+}
+
+
+void slab_adopt(slab_t *dst, slab_t *src)
+{
+    if (src->chunks == NULL)
+        return;
+
+    // The unused part of src's newest chunk is not lost, but freed
+    while (src->unused + src->object_size <= src->unused_end)
+    {
+        *(void **)src->unused = src->free_list;
+        src->free_list = src->unused;
+        src->unused += src->object_size;
+    }
+
+    if (src->free_list != NULL)
+    {
+        void **last_free = src->free_list;
+        while (*last_free != NULL)
+            last_free = *last_free;
+
+        *last_free = dst->free_list;
+        dst->free_list = src->free_list;
+    }
+
+    void **last_chunk = src->chunks;
+    while (*last_chunk != NULL)
+        last_chunk = *last_chunk;
+
+    *last_chunk = dst->chunks;
+    dst->chunks = src->chunks;
+
+    dst->chunk_count += src->chunk_count;
+    dst->used_objects += src->used_objects;
+
+    slab_init(src, src->object_size);
+}
+
+
+struct large_text
+{
+    struct large_text *prev, *next;
+    size_t size;
+} __attribute__((aligned(16)));
+
+
+void text_heap_init(text_heap_t *heap)
+{
+    for (int i = 0; i < TEXT_HEAP_CLASSES; i++)
+        slab_init(&heap->classes[i], (size_t)1 << (TEXT_HEAP_MIN_SHIFT + i));
+
+    heap->large = NULL;
+    heap->large_count = heap->large_bytes = 0;
+}
+
+
+// Returns the index of the smallest class that fits the size (or
+// TEXT_HEAP_CLASSES if none does)
+static int size_class(size_t size)
+{
+    int class = 0;
+
+    while ((class < TEXT_HEAP_CLASSES) && (size > (size_t)1 << (TEXT_HEAP_MIN_SHIFT + class)))
+        class++;
+
+    return class;
+}
+
+
+static char *alloc_large(text_heap_t *heap, size_t size)
+{
+    struct large_text *block = malloc(sizeof(*block) + size);
+
+    block->prev = NULL;
+    block->next = heap->large;
+    block->size = size;
+
+    if (heap->large != NULL)
+        heap->large->prev = block;
+    heap->large = block;
+
+    heap->large_count++;
+    heap->large_bytes += size;
+
+    return (char *)(block + 1);
+}
+
+
+static void free_large(text_heap_t *heap, char *text)
+{
+    struct large_text *block = (struct large_text *)text - 1;
+
+    if (block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        heap->large = block->next;
+
+    if (block->next != NULL)
+        block->next->prev = block->prev;
+
+    heap->large_count--;
+    heap->large_bytes -= block->size;
+
+    free(block);
+}
+
+
+char *text_heap_realloc(text_heap_t *heap, char *text, size_t old_size, size_t *size)
+{
+    int class = size_class(*size);
+
+    if (class < TEXT_HEAP_CLASSES)
+        *size = (size_t)1 << (TEXT_HEAP_MIN_SHIFT + class);
+
+    if ((text != NULL) && (*size == old_size))
+        return text;
+
+    char *new_text = (class < TEXT_HEAP_CLASSES) ? slab_alloc(&heap->classes[class]) : alloc_large(heap, *size);
+
+    if (text != NULL)
+    {
+        memcpy(new_text, text, (old_size < *size) ? old_size : *size);
+        text_heap_free(heap, text, old_size);
+    }
+
+    return new_text;
+}
+
+
+void text_heap_free(text_heap_t *heap, char *text, size_t size)
+{
+    int class = size_class(size);
+
+    if (class < TEXT_HEAP_CLASSES)
+        slab_free(&heap->classes[class], text);
+    else
+        free_large(heap, text);
+}
+
+
+void text_heap_release(text_heap_t *heap)
+{
+    for (int i = 0; i < TEXT_HEAP_CLASSES; i++)
+        slab_release(&heap->classes[i]);
+
+    while (heap->large != NULL)
+    {
+        struct large_text *next = heap->large->next;
+        free(heap->large);
+        heap->large = next;
+    }
+
+    heap->large_count = heap->large_bytes = 0;
+}
+
+
+void text_heap_adopt(text_heap_t *dst, text_heap_t *src)
+{
+    for (int i = 0; i < TEXT_HEAP_CLASSES; i++)
+        slab_adopt(&dst->classes[i], &src->classes[i]);
+
+    if (src->large != NULL)
+    {
+        struct large_text *last = src->large;
+        while (last->next != NULL)
+            last = last->next;
+
+        last->next = dst->large;
+        if (dst->large != NULL)
+            dst->large->prev = last;
+        dst->large = src->large;
+
+        dst->large_count += src->large_count;
+        dst->large_bytes += src->large_bytes;
+    }
+
+    src->large = NULL;
+    src->large_count = src->large_bytes = 0;
+}
@@ -1,35 +1,687 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
 
+#include "events.h"
 #include "input.h"
 #include "term.h"
 #include "terminfo.h"
+#include "tools.h"
+#include "utf8.h"
 
 
 int term_width = 80, term_height = 25;
 
 
+// Attribute flags of a cell
+#define ATTR_BOLD      (1 << 0)
+#define ATTR_UNDERLINE (1 << 1)
+#define ATTR_INVERT    (1 << 2)
+
+// Stored in the cell behind a double-width character
+#define WIDE_CONTINUATION UINT32_MAX
+
+// Shown for bytes that are not valid UTF-8
+#define REPLACEMENT_CHARACTER 0xfffd
+
+// Unchanged cells in front of a changed one are rather reprinted than skipped
+// if there are at most this many of them
+#define MAX_REPRINT_GAP 4
+
+
+typedef struct cell
+{
+    uint32_t codepoint;
+    // Zero-width character (e.g. a combining mark) printed over this one, or 0
+    uint32_t combining;
+    // Colors in the form returned by pack_color()
+    uint32_t fg, bg;
+    uint8_t attr;
+} cell_t;
+
+
+// What is drawn currently (screen) and what the terminal shows (shown)
+static cell_t *screen, *shown;
+// False if the terminal content is unknown
+static bool shown_valid;
+
+// Where and how the next character will be drawn
+static int cursor_x, cursor_y;
+static cell_t pen = { .codepoint = ' ' };
+static bool cursor_visible = true;
+
+// State of the terminal itself (a position of -1 means unknown)
+static int shown_x = -1, shown_y = -1;
+static cell_t shown_pen;
+static bool shown_cursor_visible = true;
+
+// Rows of the terminal to be scrolled (up if positive) before the next frame
+// is drawn
+static int scroll_top, scroll_bottom, scroll_lines;
+
+// Incomplete UTF-8 sequence written so far
+static char pending_mbc[4];
+static int pending_mbc_len;
+// True if continuation bytes belong to the last character (i.e. it has not been
+// a single ASCII byte), as utf8_measure() counts them
+static bool in_mbc;
+
+
+// Output for the terminal, written at once at the end of every frame
+static char *frame;
+static size_t frame_len, frame_size;
+
+term_stats_t term_stats;
+
+
+static void emit(const char *s, size_t len)
+{
+    if (frame_len + len > frame_size)
+    {
+        frame_size = (frame_size ? frame_size : 4096);
+        while (frame_len + len > frame_size)
+            frame_size *= 2;
+
+        frame = realloc(frame, frame_size);
+    }
+
+    memcpy(frame + frame_len, s, len);
+    frame_len += len;
+}
+
+
+static void emit_char(char c)
+{
+    emit(&c, 1);
+}
+
+
+// Writes directly to the terminal, bypassing the screen
+static void print_raw(const char *s)
+{
+    emit(s, strlen(s));
+}
+
+
+static void write_frame(void)
+{
+    if (!frame_len)
+        return;
+
+    int writes = 0;
+
+    for (size_t done = 0; done < frame_len;)
+    {
+        ssize_t ret = write(STDOUT_FILENO, frame + done, frame_len - done);
+        writes++;
+
+        if (ret > 0)
+            done += ret;
+        else if ((ret < 0) && (errno != EINTR))
+            break;
+    }
+
+    term_stats.frames++;
+    term_stats.writes += writes;
+    term_stats.bytes += frame_len;
+    if (writes > term_stats.max_frame_writes)
+        term_stats.max_frame_writes = writes;
+
+    frame_len = 0;
+}
+
+
+static uint32_t pack_color(color_t color)
+{
+    switch (color.type)
+    {
+        case COL_DEFAULT:
+            return 0;
+
+        case COL_8:
+        case COL_16:
+        case COL_256:
+            return ((uint32_t)color.type << 24) | color.color;
+
+        case COL_RGB:
+            return ((uint32_t)color.type << 24) | (color.r << 16) | (color.g << 8) | color.b;
+    }
+
+    return 0;
+}
+
+
+static inline bool same_attributes(const cell_t *c1, const cell_t *c2)
+{
+    return (c1->fg == c2->fg) && (c1->bg == c2->bg) && (c1->attr == c2->attr);
+}
+
+static inline bool same_cell(const cell_t *c1, const cell_t *c2)
+{
+    return (c1->codepoint == c2->codepoint) && (c1->combining == c2->combining) && same_attributes(c1, c2);
+}
+
+
+static void clear_cells(cell_t *cells)
+{
+    for (int i = 0; i < term_width * term_height; i++)
+        cells[i] = (cell_t){ .codepoint = ' ' };
+}
+
+
+static uint32_t decode_mbc(const char *mbc, int len)
+{
+    static const uint8_t first_byte_mask[] = { 0, 0x7f, 0x1f, 0x0f, 0x07 };
+
+    uint32_t codepoint = mbc[0] & first_byte_mask[len];
+    for (int i = 1; i < len; i++)
+        codepoint = (codepoint << 6) | (mbc[i] & 0x3f);
+
+    return codepoint;
+}
+
+
+// Puts a character on the screen at the cursor position, the way the terminal
+// would (wrapping automatically, but never scrolling)
+static void put_cell(uint32_t codepoint, int width)
+{
+    // Zero-width characters go on top of the previous one (only one of them
+    // per cell is kept, though)
+    if (!width)
+    {
+        if ((screen == NULL) || (cursor_y >= term_height) || !cursor_x || (cursor_x > term_width))
+            return;
+
+        cell_t *base = &screen[cursor_y * term_width + cursor_x - 1];
+        if ((base->codepoint == WIDE_CONTINUATION) && (cursor_x > 1))
+            base--;
+
+        if (!base->combining)
+            base->combining = codepoint;
+        return;
+    }
+
+    if (cursor_x + width > term_width)
+    {
+        cursor_x = 0;
+        cursor_y++;
+    }
+
+    if ((screen == NULL) || (cursor_y >= term_height))
+        return;
+
+
+    cell_t *row = &screen[cursor_y * term_width];
+
+    // Do not leave halves of double-width characters behind
+    if (row[cursor_x].codepoint == WIDE_CONTINUATION)
+    {
+        row[cursor_x - 1].codepoint = ' ';
+        row[cursor_x - 1].combining = 0;
+    }
+    if ((cursor_x + width < term_width) && (row[cursor_x + width].codepoint == WIDE_CONTINUATION))
+        row[cursor_x + width].codepoint = ' ';
+
+    row[cursor_x] = pen;
+    row[cursor_x].codepoint = codepoint;
+
+    if (width == 2)
+    {
+        row[cursor_x + 1] = pen;
+        row[cursor_x + 1].codepoint = WIDE_CONTINUATION;
+    }
+
+    cursor_x += width;
+}
+
+
+// A character whose sequence has been cut short is shown as one replacement
+// character, which takes one column just like utf8_width() says
+static void finish_pending_mbc(void)
+{
+    if (!pending_mbc_len)
+        return;
+
+    pending_mbc_len = 0;
+    put_cell(REPLACEMENT_CHARACTER, 1);
+}
+
+
+static void put_byte(char c)
+{
+    if ((c & 0xc0) == 0x80)
+    {
+        if (pending_mbc_len)
+        {
+            pending_mbc[pending_mbc_len++] = c;
+
+            int len = utf8_mbclen(pending_mbc[0]);
+            if (pending_mbc_len < len)
+                return;
+
+            pending_mbc_len = 0;
+
+            uint32_t codepoint = decode_mbc(pending_mbc, len);
+            int width = utf8_codepoint_width(codepoint);
+            if ((codepoint > 0x10ffff) || ((codepoint >= 0xd800) && (codepoint <= 0xdfff)))
+                codepoint = REPLACEMENT_CHARACTER;
+
+            put_cell(codepoint, width);
+        }
+        else if (!in_mbc)
+        {
+            // Stray continuation bytes behind an ASCII character form one of
+            // their own
+            put_cell(REPLACEMENT_CHARACTER, 1);
+            in_mbc = true;
+        }
+
+        // Otherwise, they belong to the character in front of them
+        return;
+    }
+
+    // Whatever has been pending is cut short by this byte
+    finish_pending_mbc();
+
+    in_mbc = c & 0x80;
+    if (in_mbc)
+    {
+        if (utf8_mbclen(c) > 1)
+            pending_mbc[pending_mbc_len++] = c;
+        else
+            put_cell(REPLACEMENT_CHARACTER, 1);
+        return;
+    }
+
+    switch (c)
+    {
+        case '\n':
+            cursor_x = 0;
+            cursor_y++;
+            break;
+
+        case '\r':
+            cursor_x = 0;
+            break;
+
+        case '\b':
+            if (cursor_x)
+                cursor_x--;
+            break;
+
+        default:
+            // Other control characters take up a cell like any character
+            put_cell((uint8_t)c, 1);
+    }
+}
+
+
+static void term_write(const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        put_byte(s[i]);
+}
+
+
 void print(const char *s)
 {
-    fwrite(s, 1, strlen(s), stdout);
+    term_write(s, strlen(s));
 }
 
 
-void print_flushed(const char *s)
+void term_putchar(int c)
 {
-    print(s);
-    fflush(stdout);
+    put_byte(c);
+}
+
+
+int term_vprintf(const char *format, va_list va)
+{
+    char local[256], *s = local;
+
+    va_list vac;
+    va_copy(vac, va);
+    int len = vsnprintf(local, sizeof(local), format, vac);
+    va_end(vac);
+
+    if (len < 0)
+        return len;
+
+    if ((size_t)len >= sizeof(local))
+    {
+        s = malloc(len + 1);
+        vsnprintf(s, len + 1, format, va);
+    }
+
+    term_write(s, len);
+
+    if (s != local)
+        free(s);
+
+    return len;
+}
+
+
+int term_printf(const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    int len = term_vprintf(format, va);
+    va_end(va);
+
+    return len;
+}
+
+
+// Appends an SGR parameter to the sequence in "seq"
+static void add_sgr(char *seq, int *len, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+static void add_sgr(char *seq, int *len, const char *format, ...)
+{
+    if (*len > 2)
+        seq[(*len)++] = ';';
+
+    va_list va;
+    va_start(va, format);
+    *len += vsnprintf(seq + *len, 32, format, va);
+    va_end(va);
+}
+
+
+static void add_sgr_color(char *seq, int *len, uint32_t color, bool background)
+{
+    int value = color & 0xffffff, base = background ? 40 : 30;
+
+    switch (color >> 24)
+    {
+        case COL_DEFAULT:
+            add_sgr(seq, len, "%i", base + 9);
+            break;
+
+        case COL_8:
+        case COL_16:
+            add_sgr(seq, len, "%i", base + (value & 7));
+            break;
+
+        case COL_256:
+            add_sgr(seq, len, "%i;5;%i", base + 8, value);
+            break;
+
+        case COL_RGB:
+            add_sgr(seq, len, "%i;2;%i;%i;%i", base + 8, value >> 16, (value >> 8) & 0xff, value & 0xff);
+    }
+}
+
+
+// Switches the terminal to the cell's attributes with a single SGR sequence,
+// which either only changes what differs or resets everything first
+static void emit_attributes(const cell_t *cell)
+{
+    if (same_attributes(cell, &shown_pen))
+        return;
+
+    char delta[128] = "\033[", reset[128] = "\033[";
+    int delta_len = 2, reset_len = 2;
+
+    int changed = cell->attr ^ shown_pen.attr;
+    if (changed & ATTR_BOLD)
+        add_sgr(delta, &delta_len, "%i", (cell->attr & ATTR_BOLD) ? 1 : 22);
+    if (changed & ATTR_UNDERLINE)
+        add_sgr(delta, &delta_len, "%i", (cell->attr & ATTR_UNDERLINE) ? 4 : 24);
+    if (changed & ATTR_INVERT)
+        add_sgr(delta, &delta_len, "%i", (cell->attr & ATTR_INVERT) ? 7 : 27);
+    if (cell->fg != shown_pen.fg)
+        add_sgr_color(delta, &delta_len, cell->fg, false);
+    if (cell->bg != shown_pen.bg)
+        add_sgr_color(delta, &delta_len, cell->bg, true);
+
+    add_sgr(reset, &reset_len, "0");
+    if (cell->attr & ATTR_BOLD)
+        add_sgr(reset, &reset_len, "1");
+    if (cell->attr & ATTR_UNDERLINE)
+        add_sgr(reset, &reset_len, "4");
+    if (cell->attr & ATTR_INVERT)
+        add_sgr(reset, &reset_len, "7");
+    if (cell->fg)
+        add_sgr_color(reset, &reset_len, cell->fg, false);
+    if (cell->bg)
+        add_sgr_color(reset, &reset_len, cell->bg, true);
+
+    // An empty parameter list resets everything just as well
+    if (reset_len == 3)
+        reset_len = 2;
+
+    if (reset_len < delta_len)
+        emit(reset, reset_len);
+    else
+        emit(delta, delta_len);
+    emit_char('m');
+
+    shown_pen = *cell;
+}
+
+
+static void emit_codepoint(uint32_t codepoint)
+{
+    // Control characters would move the terminal's cursor
+    if ((codepoint < 0x20) || (codepoint == 0x7f))
+        emit_char('?');
+    else if (codepoint < 0x80)
+        emit_char(codepoint);
+    else if (codepoint < 0x800)
+    {
+        emit_char(0xc0 | (codepoint >> 6));
+        emit_char(0x80 | (codepoint & 0x3f));
+    }
+    else if (codepoint < 0x10000)
+    {
+        emit_char(0xe0 | (codepoint >> 12));
+        emit_char(0x80 | ((codepoint >> 6) & 0x3f));
+        emit_char(0x80 | (codepoint & 0x3f));
+    }
+    else
+    {
+        emit_char(0xf0 | (codepoint >> 18));
+        emit_char(0x80 | ((codepoint >> 12) & 0x3f));
+        emit_char(0x80 | ((codepoint >> 6) & 0x3f));
+        emit_char(0x80 | (codepoint & 0x3f));
+    }
+}
+
+
+// Prints the cell at the given position (which has to be the terminal's
+// cursor position) and returns its width
+static int emit_cell(int x, int y)
+{
+    const cell_t *cell = &screen[y * term_width + x];
+    int width = ((x + 1 < term_width) && (cell[1].codepoint == WIDE_CONTINUATION)) ? 2 : 1;
+
+    emit_attributes(cell);
+    emit_codepoint((cell->codepoint == WIDE_CONTINUATION) ? ' ' : cell->codepoint);
+    if (cell->combining)
+        emit_codepoint(cell->combining);
+
+    for (int i = 0; i < width; i++)
+        shown[y * term_width + x + i] = cell[i];
+
+    // The terminal's cursor position is undefined behind the last column
+    shown_x = (x + width < term_width) ? (x + width) : -1;
+
+    return width;
+}
+
+
+// Moves the terminal's cursor, using the shortest sequence that does it
+static void move_cursor(int x, int y)
+{
+    if ((shown_x == x) && (shown_y == y))
+        return;
+
+    char best[32];
+    int best_len = snprintf(best, sizeof(best), "\033[%i;%iH", y + 1, x + 1);
+
+    if ((shown_y == y) && (shown_x >= 0))
+    {
+        char alt[32];
+        int alt_len;
+
+        if (!x)
+            alt_len = snprintf(alt, sizeof(alt), "\r");
+        else if (x > shown_x)
+            alt_len = snprintf(alt, sizeof(alt), "\033[%iC", x - shown_x);
+        else
+            alt_len = snprintf(alt, sizeof(alt), "\033[%iD", shown_x - x);
+
+        if (alt_len < best_len)
+            best_len = snprintf(best, sizeof(best), "%s", alt);
+
+        // Reprinting what is there already may be shorter still
+        if ((x > shown_x) && (x - shown_x <= MAX_REPRINT_GAP) && (x - shown_x < best_len))
+        {
+            const cell_t *row = &screen[y * term_width];
+            bool reprint = true;
+
+            for (int i = shown_x; reprint && (i < x); i++)
+                reprint = (row[i].codepoint < 0x80) && (row[i].codepoint >= 0x20) && !row[i].combining && same_attributes(&row[i], &shown_pen);
+
+            if (reprint)
+            {
+                for (int i = shown_x; i < x; i++)
+                    emit_char(row[i].codepoint);
+
+                shown_x = x;
+                return;
+            }
+        }
+    }
+    else if ((shown_y + 1 == y) && !x && (shown_y >= 0))
+        best_len = snprintf(best, sizeof(best), "\r\n");
+
+    emit(best, best_len);
+
+    shown_x = x;
+    shown_y = y;
+}
+
+
+void term_scroll(int top, int bottom, int lines)
+{
+    // Only one region can be scrolled per frame
+    if (scroll_lines && ((top != scroll_top) || (bottom != scroll_bottom)))
+        scroll_lines = 0;
+
+    scroll_top = top;
+    scroll_bottom = bottom;
+    scroll_lines += lines;
+}
+
+
+// Lets the terminal scroll the requested region, so whatever has only moved
+// does not have to be printed again
+static void scroll_shown(void)
+{
+    int height = scroll_bottom - scroll_top + 1;
+    int lines = (scroll_lines > 0) ? scroll_lines : -scroll_lines;
+
+    // Rows scrolled in take the current background color
+    cell_t blank = { .codepoint = ' ' };
+    emit_attributes(&blank);
+
+    char seq[64];
+    int len = snprintf(seq, sizeof(seq), "\033[%i;%ir\033[%i%c\033[r", scroll_top + 1, scroll_bottom + 1, lines, (scroll_lines > 0) ? 'S' : 'T');
+    emit(seq, len);
+
+    // Setting the region moves the cursor
+    shown_x = shown_y = -1;
+
+
+    cell_t *region = &shown[scroll_top * term_width];
+    size_t kept = (height - lines) * term_width * sizeof(cell_t);
+
+    if (scroll_lines > 0)
+    {
+        memmove(region, region + lines * term_width, kept);
+        region += (height - lines) * term_width;
+    }
+    else
+        memmove(region + lines * term_width, region, kept);
+
+    for (int i = 0; i < lines * term_width; i++)
+        region[i] = blank;
+}
+
+
+void term_flush(void)
+{
+    finish_pending_mbc();
+
+    if (screen == NULL)
+    {
+        write_frame();
+        return;
+    }
+
+
+    if (!shown_valid)
+    {
+        print_raw("\033[0m\033[2J\033[H");
+        clear_cells(shown);
+
+        shown_pen = (cell_t){ .codepoint = ' ' };
+        shown_x = shown_y = 0;
+        shown_valid = true;
+    }
+    else if (scroll_lines && (abs(scroll_lines) <= scroll_bottom - scroll_top))
+        scroll_shown();
+
+    scroll_lines = 0;
+
+    for (int y = 0; y < term_height; y++)
+    {
+        for (int x = 0; x < term_width; x++)
+        {
+            int i = y * term_width + x;
+
+            // Double-width characters are printed with their left half
+            bool changed = !same_cell(&screen[i], &shown[i]) || ((x + 1 < term_width) && (screen[i + 1].codepoint == WIDE_CONTINUATION) && !same_cell(&screen[i + 1], &shown[i + 1]));
+
+            if (!changed || ((screen[i].codepoint == WIDE_CONTINUATION) && x))
+                continue;
+
+            move_cursor(x, y);
+            x += emit_cell(x, y) - 1;
+        }
+    }
+
+
+    if (cursor_visible)
+        move_cursor((cursor_x < term_width) ? cursor_x : term_width - 1, (cursor_y < term_height) ? cursor_y : term_height - 1);
+
+    if (cursor_visible != shown_cursor_visible)
+    {
+        print_raw(cursor_visible ? "\033[?25h" : "\033[?25l");
+        shown_cursor_visible = cursor_visible;
+    }
+
+    write_frame();
 }
 
 
 static struct termios initial_tios;
 static bool claimed = false;
 
+// Receives SIGWINCH
+static int resize_fd = -1;
+
 
 void term_release(void)
 {
@@ -41,22 +693,60 @@ void term_release(void)
 
     if (!cleared)
     {
-        term_clear();
-        fflush(stdout);
-
+        print_raw("\033[0m\033[2J\033[H");
         cleared = true;
     }
 
-    term_show_cursor(true);
+    print_raw("\033[?25h");
 
     tcsetattr(STDIN_FILENO, TCSANOW, &initial_tios);
-    print_flushed("\033[?1000;1002;1006;1015l");
+    print_raw("\033[?1000;1002;1006;1015l\033[?2004l");
+    write_frame();
+}
+
+
+static void allocate_screen(void)
+{
+    screen = realloc(screen, term_width * term_height * sizeof(*screen));
+    shown  = realloc(shown,  term_width * term_height * sizeof(*shown));
+    clear_cells(screen);
+
+    // The next frame is drawn from scratch
+    shown_valid = false;
+    scroll_lines = 0;
+}
+
+
+static void handle_resize(void *info)
+{
+    (void)info;
+
+    struct signalfd_siginfo si;
+    while (read(resize_fd, &si, sizeof(si)) == sizeof(si));
+
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) || !ws.ws_col || !ws.ws_row)
+        return;
+
+    if ((ws.ws_col == term_width) && (ws.ws_row == term_height))
+        return;
+
+    term_width  = ws.ws_col;
+    term_height = ws.ws_row;
+
+    allocate_screen();
+
+    trigger_event((event_t){ EVENT_TERM_RESIZE });
 }
 
 
 void term_init(void)
 {
     terminfo_load();
+    startup_phase("term_init: terminfo");
+
+    input_init();
+    startup_phase("term_init: input");
 
     struct winsize ws;
     ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
@@ -64,6 +754,19 @@ void term_init(void)
     term_width  = ws.ws_col;
     term_height = ws.ws_row;
 
+    allocate_screen();
+
+    // Resizes are handled in the main loop; this has to be done before any
+    // other thread is started, so none of them gets the signal
+    sigset_t winch;
+    sigemptyset(&winch);
+    sigaddset(&winch, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &winch, NULL);
+
+    resize_fd = signalfd(-1, &winch, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (resize_fd >= 0)
+        input_watch_fd(resize_fd, handle_resize, NULL);
+
     tcgetattr(STDIN_FILENO, &initial_tios);
 
     claimed = true;
@@ -77,98 +780,72 @@ void term_init(void)
     tcsetattr(STDIN_FILENO, TCSANOW, &tios);
 
     setbuf(stdin, NULL);
-    setvbuf(stdout, NULL, _IOFBF, 0);
 
     // Mouse support
-    print_flushed("\033[?1000;1002;1006;1015h");
-
-    init_mouse_input_regex();
+    print_raw("\033[?1000;1002;1006;1015h");
+    // Pasted text is enclosed in markers (so it can be inserted at once)
+    print_raw("\033[?2004h");
 
     term_show_cursor(false);
-    fflush(stdout);
+    term_flush();
+
+    startup_phase("term_init: terminal setup");
 }
 
 
 void term_clear(void)
 {
-    print("\033[2J\033[H");
+    if (screen != NULL)
+        clear_cells(screen);
+
+    cursor_x = cursor_y = 0;
+    pending_mbc_len = 0;
+    in_mbc = false;
 }
 
 
 void term_underline(bool ul)
 {
-    print(ul ? "\033[4m" : "\033[24m");
+    pen.attr = ul ? (pen.attr | ATTR_UNDERLINE) : (pen.attr & ~ATTR_UNDERLINE);
 }
 
 
 void term_bold(bool bold)
 {
-    print(bold ? "\033[1m" : "\033[22m");
+    pen.attr = bold ? (pen.attr | ATTR_BOLD) : (pen.attr & ~ATTR_BOLD);
 }
 
 
 void term_set_color(color_t fg, color_t bg)
 {
-    switch (fg.type)
-    {
-        case COL_DEFAULT:
-            print("\033[22;39m");
-            break;
-
-        case COL_8:
-            printf("\033[3%im", fg.color & 7);
-            break;
-
-        case COL_16:
-            if (fg.color & 8)
-                printf("\033[1;3%im", fg.color & 7);
-            else
-                printf("\033[22;3%im", fg.color & 7);
-            break;
-
-        case COL_256:
-            printf("\033[38;5;%im", fg.color);
-            break;
-
-        case COL_RGB:
-            printf("\033[38;2;%i;%i;%im", fg.r, fg.g, fg.b);
-    }
-
-    switch (bg.type)
-    {
-        case COL_DEFAULT:
-            print("\033[49m");
-            break;
-
-        case COL_8:
-        case COL_16:
-            printf("\033[4%im", bg.color & 7);
-            break;
-
-        case COL_256:
-            printf("\033[48;5;%im", bg.color);
-            break;
-
-        case COL_RGB:
-            printf("\033[48;2;%i;%i;%im", bg.r, bg.g, bg.b);
-    }
+    // Bright colors of the 16 color palette are bold dark ones
+    if ((fg.type == COL_16) && (fg.color & 8))
+        term_bold(true);
+    else if ((fg.type == COL_DEFAULT) || (fg.type == COL_16))
+        term_bold(false);
+
+    pen.fg = pack_color(fg);
+    pen.bg = pack_color(bg);
 }
 
 void term_invert(bool invert)
 {
-    print(invert ? "\033[7m" : "\033[27m");
+    pen.attr = invert ? (pen.attr | ATTR_INVERT) : (pen.attr & ~ATTR_INVERT);
 }
 
 void term_cursor_pos(int x, int y)
 {
+    finish_pending_mbc();
+    in_mbc = false;
+
     y += x / term_width;
     x %= term_width;
 
-    printf("\033[%i;%iH", y + 1, x + 1);
-    fflush(stdout);
+    cursor_x = x;
+    cursor_y = y;
 }
 
 void term_show_cursor(bool show)
 {
-    printf("\033[?25%c", show ? 'h' : 'l');
+    cursor_visible = show;
 }
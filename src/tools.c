@@ -1,3 +1,13 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 #include "tools.h"
 
 
@@ -13,3 +23,170 @@ int get_decimal_length(int number)
 
     return len;
 }
+
+
+int64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static FILE *startup_report;
+static int64_t startup_begin_us, last_phase_us;
+
+static int64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+bool startup_report_open(const char *path)
+{
+    startup_report = fopen(path, "a");
+    if (startup_report == NULL)
+        return false;
+
+    startup_begin_us = last_phase_us = get_time_us();
+
+    fprintf(startup_report, "\ntimes in msec\n   clock     self: phase\n");
+    return true;
+}
+
+
+void startup_phase(const char *format, ...)
+{
+    if (startup_report == NULL)
+        return;
+
+    int64_t now = get_time_us();
+
+    fprintf(startup_report, "%8.3f %8.3f: ", (now - startup_begin_us) / 1000., (now - last_phase_us) / 1000.);
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(startup_report, format, args);
+    va_end(args);
+
+    fputc('\n', startup_report);
+
+    // Do not count writing the report itself
+    last_phase_us = get_time_us();
+}
+
+
+void startup_report_close(void)
+{
+    if (startup_report == NULL)
+        return;
+
+    fclose(startup_report);
+    startup_report = NULL;
+}
+
+
+static size_t find_newlines_scalar(const char *str, size_t len, const char **found, size_t max)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; (i < len) && (count < max); i++)
+        if (str[i] == '\n')
+            found[count++] = &str[i];
+
+    return count;
+}
+
+
+#ifdef __x86_64__
+// Records the newlines marked in the bit mask of a block
+#define FOUND_FROM_MASK(mask, block) \
+    while (mask) \
+    { \
+        if (count >= max) \
+            return count; \
+        found[count++] = &(block)[__builtin_ctz(mask)]; \
+        mask &= mask - 1; \
+    }
+
+
+static size_t find_newlines_sse2(const char *str, size_t len, const char **found, size_t max)
+{
+    size_t count = 0, i = 0;
+    __m128i nl = _mm_set1_epi8('\n');
+
+    for (; i + 16 <= len; i += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&str[i]), nl));
+        FOUND_FROM_MASK(mask, &str[i])
+    }
+
+    return count + find_newlines_scalar(&str[i], len - i, &found[count], max - count);
+}
+
+
+__attribute__((target("avx2")))
+static size_t find_newlines_avx2(const char *str, size_t len, const char **found, size_t max)
+{
+    size_t count = 0, i = 0;
+    __m256i nl = _mm256_set1_epi8('\n');
+
+    for (; i + 32 <= len; i += 32)
+    {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&str[i]), nl));
+        FOUND_FROM_MASK(mask, &str[i])
+    }
+
+    return count + find_newlines_sse2(&str[i], len - i, &found[count], max - count);
+}
+#endif
+
+
+static const struct
+{
+    const char *name;
+    size_t (*find)(const char *str, size_t len, const char **found, size_t max);
+} find_newlines_impls[] = {
+    { "scalar", find_newlines_scalar },
+#ifdef __x86_64__
+    { "SSE2", find_newlines_sse2 },
+    { "AVX2", find_newlines_avx2 },
+#endif
+};
+
+static int find_newlines_impl_count;
+static size_t (*find_newlines_impl)(const char *str, size_t len, const char **found, size_t max);
+
+__attribute__((constructor))
+static void select_find_newlines(void)
+{
+    find_newlines_impl_count = 1;
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    find_newlines_impl_count = __builtin_cpu_supports("avx2") ? 3 : 2;
+#endif
+    find_newlines_impl = find_newlines_impls[find_newlines_impl_count - 1].find;
+}
+
+
+int find_newlines_implementations(void)
+{
+    return find_newlines_impl_count;
+}
+
+
+const char *find_newlines_select(int index)
+{
+    find_newlines_impl = find_newlines_impls[index].find;
+    return find_newlines_impls[index].name;
+}
+
+
+size_t find_newlines(const char *str, size_t len, const char **found, size_t max)
+{
+    return find_newlines_impl(str, len, found, max);
+}
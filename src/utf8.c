@@ -1,64 +1,482 @@
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "utf8.h"
+#include "unicode_width.h"
 
 
-size_t utf8_strlen(const char *str)
+// Characters are counted by their first bytes, as described in utf8.h.
+// All characters below U+0300 are one column wide, so only lead bytes from
+// 0xcc on need to be looked up.
+
+static void measure_scalar(const char *str, size_t n, bool prev_ascii, bool want_width, size_t *chars, size_t *width)
 {
-    size_t len = 0;
+    size_t c = 0;
+    ptrdiff_t w = 0;
 
-    for (size_t i = 0; str[i]; len++)
-        if (str[i++] & 0x80)
-            while ((str[i] & 0xc0) == 0x80)
-                i++;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t byte = str[i];
 
-    return len;
+        c += ((byte & 0xc0) != 0x80) | prev_ascii;
+        prev_ascii = byte < 0x80;
+
+        // Only the first byte of a character can be this large
+        if (want_width && (byte >= 0xcc))
+            w += utf8_width(&str[i], n - i) - 1;
+    }
+
+    *chars = c;
+    *width = c + w;
 }
 
-size_t utf8_strlen_vis(const char *str)
+
+// Strict validation as per RFC 3629 (no overlong encodings, no surrogates,
+// nothing beyond U+10FFFF)
+static bool validate_scalar(const char *str, size_t n)
 {
-    size_t len = 0;
+    static const uint32_t min_codepoint[] = { 0, 0, 0x80, 0x800, 0x10000 };
 
-    for (size_t i = 0; str[i]; ++len)
-        if (str[i++] & 0x80)
+    const uint8_t *s = (const uint8_t *)str;
+    size_t i = 0;
+
+    while (i < n)
+    {
+        uint64_t word;
+        if ((i + sizeof(word) <= n) && (memcpy(&word, &s[i], sizeof(word)), !(word & 0x8080808080808080ull)))
         {
-            if (utf8_is_dbc(&str[i - 1]))
-                len++;
+            i += sizeof(word);
+            continue;
+        }
 
-            while ((str[i] & 0xc0) == 0x80)
-                i++;
+        if (s[i] < 0x80)
+        {
+            i++;
+            continue;
+        }
+
+        int len = ((s[i] & 0xe0) == 0xc0) ? 2 : ((s[i] & 0xf0) == 0xe0) ? 3 : ((s[i] & 0xf8) == 0xf0) ? 4 : 0;
+        if (!len || (n - i < (size_t)len))
+            return false;
+
+        uint32_t codepoint = s[i] & (0x7f >> len);
+        for (int j = 1; j < len; j++)
+        {
+            if ((s[i + j] & 0xc0) != 0x80)
+                return false;
+            codepoint = (codepoint << 6) | (s[i + j] & 0x3f);
+        }
+
+        if ((codepoint < min_codepoint[len]) || (codepoint > 0x10ffff) || ((codepoint >= 0xd800) && (codepoint <= 0xdfff)))
+            return false;
+
+        i += len;
+    }
+
+    return true;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+// Counts the character starts among up to 32 bytes, given as masks of all
+// bytes with the top bit set and of all continuation bytes
+static inline size_t count_starts(uint32_t high, uint32_t cont, int bytes, bool prev_ascii)
+{
+    uint32_t all = (bytes == 32) ? UINT32_MAX : ((1u << bytes) - 1);
+    uint32_t ascii_before = ((~high << 1) | prev_ascii) & all;
+
+    return __builtin_popcount(((~cont & all) | (cont & ascii_before)));
+}
+
+
+// Returns how many columns the characters starting at the given bytes take
+// beyond one each (with n bytes left from the start of the block on)
+static ptrdiff_t width_beyond_one(const char *block, size_t n, uint32_t starts)
+{
+    ptrdiff_t w = 0;
+
+    for (; starts; starts &= starts - 1)
+    {
+        int k = __builtin_ctz(starts);
+        w += utf8_width(&block[k], n - k) - 1;
+    }
+
+    return w;
+}
+
+
+__attribute__((target("sse2")))
+static void measure_sse2(const char *str, size_t n, bool prev_ascii, bool want_width, size_t *chars, size_t *width)
+{
+    size_t c = 0, i;
+    ptrdiff_t w = 0;
+
+    const __m128i cont_limit = _mm_set1_epi8((char)0xc0);
+    const __m128i lookup_limit = _mm_set1_epi8((char)0xcb);
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&str[i]);
+        uint32_t high = _mm_movemask_epi8(v);
+
+        // Plain ASCII
+        if (!high)
+        {
+            c += 16;
+            prev_ascii = true;
+            continue;
         }
 
-    return len;
+        // Signed comparisons: continuation bytes are the ones below 0xc0,
+        // bytes from 0xcc on are above 0xcb (and so is ASCII)
+        uint32_t cont = _mm_movemask_epi8(_mm_cmplt_epi8(v, cont_limit));
+        c += count_starts(high, cont, 16, prev_ascii);
+
+        if (want_width)
+            w += width_beyond_one(&str[i], n - i, _mm_movemask_epi8(_mm_cmpgt_epi8(v, lookup_limit)) & high);
+
+        prev_ascii = !(high & 0x8000);
+    }
+
+    size_t tail_chars, tail_width;
+    measure_scalar(&str[i], n - i, prev_ascii, want_width, &tail_chars, &tail_width);
+
+    *chars = c + tail_chars;
+    *width = c + w + tail_width;
 }
 
-bool utf8_is_dbc(const char *str)
+
+__attribute__((target("avx2,popcnt")))
+static void measure_avx2(const char *str, size_t n, bool prev_ascii, bool want_width, size_t *chars, size_t *width)
 {
-    int clen = utf8_mbclen(*str);
+    size_t c = 0, i;
+    ptrdiff_t w = 0;
+
+    const __m256i cont_limit = _mm256_set1_epi8((char)0xc0);
+    const __m256i lookup_limit = _mm256_set1_epi8((char)0xcb);
 
-    if (clen == 3 || clen == 4)
+    for (i = 0; i + 32 <= n; i += 32)
     {
-        uint32_t utf8 = 0;
-
-        for (int i = 0; i < clen; ++i)
-            utf8 = (utf8 << 8) | str[i];
-
-        if (   (utf8 >= 0x00e2ba80 && utf8 <= 0x00e2bf9f)
-            || (utf8 >= 0x00e2bfb0 && utf8 <= 0x00e380bf)
-            || (utf8 >= 0x00e38780 && utf8 <= 0x00e387af)
-            || (utf8 >= 0x00e38880 && utf8 <= 0x00e4b6bf)
-            || (utf8 >= 0x00e4b880 && utf8 <= 0x00e9bfbf)
-            || (utf8 >= 0x00efa480 && utf8 <= 0x00efabbf)
-            || (utf8 >= 0x00efb8b0 && utf8 <= 0x00efb98f)
-            || (utf8 >= 0xf0a08080 && utf8 <= 0xf0aa9b9f)
-            || (utf8 >= 0xf0aa9c80 && utf8 <= 0xf0aba09f)
-            || (utf8 >= 0xf0afa080 && utf8 <= 0xf0afa89f)
-        )
-            return true;
+        __m256i v = _mm256_loadu_si256((const __m256i *)&str[i]);
+        uint32_t high = _mm256_movemask_epi8(v);
+
+        if (!high)
+        {
+            c += 32;
+            prev_ascii = true;
+            continue;
+        }
+
+        uint32_t cont = _mm256_movemask_epi8(_mm256_cmpgt_epi8(cont_limit, v));
+        uint32_t ascii_before = (~high << 1) | prev_ascii;
+        c += _mm_popcnt_u32(~cont | (cont & ascii_before));
+
+        if (want_width)
+            w += width_beyond_one(&str[i], n - i, _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, lookup_limit)) & high);
+
+        prev_ascii = !(high & 0x80000000u);
     }
 
-    return false;
+    size_t tail_chars, tail_width;
+    measure_sse2(&str[i], n - i, prev_ascii, want_width, &tail_chars, &tail_width);
+
+    *chars = c + tail_chars;
+    *width = c + w + tail_width;
+}
+
+
+// Table-driven validation after Keiser and Lemire ("Validating UTF-8 in less
+// than one instruction per byte"): every byte pair is classified by three
+// table lookups (high and low nibble of the first byte, high nibble of the
+// second one), whose results have a common bit set only for invalid pairs.
+// Third and fourth bytes are checked separately.
+
+#define TOO_SHORT       (1 << 0)
+#define TOO_LONG        (1 << 1)
+#define OVERLONG_3      (1 << 2)
+#define TOO_LARGE       (1 << 3)
+#define SURROGATE       (1 << 4)
+#define OVERLONG_2      (1 << 5)
+#define TOO_LARGE_1000  (1 << 6)
+#define OVERLONG_4      (1 << 6)
+#define TWO_CONTS       (1 << 7)
+#define CARRY           (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define LOOKUP_TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2")))
+static inline __m256i high_nibbles(__m256i v)
+{
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f));
+}
+
+// Shifts the block by n bytes, filling in the last ones of the previous block
+#define PREV_BYTES(v, prev, n) _mm256_alignr_epi8((v), _mm256_permute2x128_si256((prev), (v), 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static inline __m256i block_errors(__m256i v, __m256i prev)
+{
+    const __m256i byte_1_high_table = LOOKUP_TABLE(
+        // ASCII
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        // Continuation bytes
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        // Lead bytes (110x, 1110, 1111)
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+
+    const __m256i byte_1_low_table = LOOKUP_TABLE(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000);
+
+    const __m256i byte_2_high_table = LOOKUP_TABLE(
+        // ASCII
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        // Continuation bytes (1000, 1001, 101x)
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        // Lead bytes
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+    __m256i prev1 = PREV_BYTES(v, prev, 1);
+
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high_table, high_nibbles(prev1)),
+                         _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, _mm256_set1_epi8(0x0f)))),
+        _mm256_shuffle_epi8(byte_2_high_table, high_nibbles(v)));
+
+    // Bytes two or three places behind a three or four byte lead have to be
+    // continuation bytes (which the tables above expect to be in error)
+    __m256i third = _mm256_subs_epu8(PREV_BYTES(v, prev, 2), _mm256_set1_epi8(0xe0 - 0x80));
+    __m256i fourth = _mm256_subs_epu8(PREV_BYTES(v, prev, 3), _mm256_set1_epi8((char)(0xf0 - 0x80)));
+    __m256i must_be_cont = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+
+    return _mm256_xor_si256(must_be_cont, special);
+}
+
+// Nonzero if the block ends in a character that has been cut off
+__attribute__((target("avx2")))
+static inline __m256i block_incomplete(__m256i v)
+{
+    const __m256i max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+
+    return _mm256_subs_epu8(v, max);
+}
+
+__attribute__((target("avx2")))
+static bool validate_avx2(const char *str, size_t n)
+{
+    __m256i error = _mm256_setzero_si256(), prev = _mm256_setzero_si256(), prev_incomplete = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i < n; i += 32)
+    {
+        __m256i v;
+
+        if (i + 32 <= n)
+            v = _mm256_loadu_si256((const __m256i *)&str[i]);
+        else
+        {
+            // Pad the rest with NULs, which are valid
+            char tail[32] = { 0 };
+            memcpy(tail, &str[i], n - i);
+            v = _mm256_loadu_si256((const __m256i *)tail);
+        }
+
+        if (!_mm256_movemask_epi8(v))
+            error = _mm256_or_si256(error, prev_incomplete);
+        else
+        {
+            error = _mm256_or_si256(error, block_errors(v, prev));
+            prev_incomplete = block_incomplete(v);
+        }
+
+        prev = v;
+    }
+
+    error = _mm256_or_si256(error, prev_incomplete);
+
+    return _mm256_testz_si256(error, error);
+}
+
+#undef TOO_SHORT
+#undef TOO_LONG
+#undef OVERLONG_3
+#undef TOO_LARGE
+#undef SURROGATE
+#undef OVERLONG_2
+#undef TOO_LARGE_1000
+#undef OVERLONG_4
+#undef TWO_CONTS
+#undef CARRY
+#undef LOOKUP_TABLE
+#undef PREV_BYTES
+
+#endif
+
+
+static const struct
+{
+    const char *name;
+    void (*measure)(const char *str, size_t n, bool prev_ascii, bool want_width, size_t *chars, size_t *width);
+    bool (*validate)(const char *str, size_t n);
+} implementations[] = {
+    { "scalar", measure_scalar, validate_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+    // Validation needs byte shuffles, which SSE2 does not have
+    { "SSE2", measure_sse2, validate_scalar },
+    { "AVX2", measure_avx2, validate_avx2 },
+#endif
+};
+
+static int best_implementation, implementation;
+
+
+__attribute__((constructor))
+static void select_implementation(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        best_implementation = 2;
+    else if (__builtin_cpu_supports("sse2"))
+        best_implementation = 1;
+#endif
+
+    implementation = best_implementation;
+}
+
+
+const char *utf8_implementation(void)
+{
+    return implementations[implementation].name;
+}
+
+
+void utf8_force_scalar(bool scalar)
+{
+    implementation = scalar ? 0 : best_implementation;
+}
+
+
+void utf8_measure(const char *str, size_t n, size_t *chars, size_t *width)
+{
+    // Not worth going through the vector setup for (very common) short runs
+    if (n < 16)
+    {
+        measure_scalar(str, n, true, true, chars, width);
+        return;
+    }
+
+    implementations[implementation].measure(str, n, true, true, chars, width);
+}
+
+
+bool utf8_validate(const char *str, size_t n)
+{
+    if (n < 32)
+        return validate_scalar(str, n);
+
+    return implementations[implementation].validate(str, n);
+}
+
+
+size_t utf8_strlen(const char *str)
+{
+    return utf8_strnlen(str, SIZE_MAX);
+}
+
+// Only considers the first n bytes of str
+size_t utf8_strnlen(const char *str, size_t n)
+{
+    size_t chars, width;
+    implementations[implementation].measure(str, strnlen(str, n), true, false, &chars, &width);
+
+    return chars;
+}
+
+size_t utf8_strlen_vis(const char *str)
+{
+    return utf8_strnlen_vis(str, SIZE_MAX);
+}
+
+size_t utf8_strnlen_vis(const char *str, size_t n)
+{
+    size_t chars, width;
+    implementations[implementation].measure(str, strnlen(str, n), true, true, &chars, &width);
+
+    return width;
+}
+
+int utf8_codepoint_width(uint32_t codepoint)
+{
+    if (codepoint > 0x10ffff)
+        return 1;
+
+    const uint8_t *block = unicode_width_blocks[unicode_width_index[codepoint >> UNICODE_WIDTH_BLOCK_BITS]];
+    unsigned in_block = codepoint & ((1u << UNICODE_WIDTH_BLOCK_BITS) - 1);
+
+    return (block[in_block / 4] >> (in_block % 4 * 2)) & 3;
+}
+
+static const uint8_t first_byte_mask[] = { 0, 0x7f, 0x1f, 0x0f, 0x07 };
+
+int utf8_width(const char *str, size_t n)
+{
+    int len = utf8_mbclen(*str);
+    if ((len == 1) || (n < (size_t)len))
+        return 1;
+
+    uint32_t codepoint = str[0] & first_byte_mask[len];
+    for (int i = 1; i < len; i++)
+    {
+        // Broken sequences are shown as one character each
+        if ((str[i] & 0xc0) != 0x80)
+            return 1;
+
+        codepoint = (codepoint << 6) | (str[i] & 0x3f);
+    }
+
+    return utf8_codepoint_width(codepoint);
+}
+
+int utf8_width_valid(const char *str)
+{
+    int len = utf8_mbclen(*str);
+    if (len == 1)
+        return 1;
+
+    uint32_t codepoint = str[0] & first_byte_mask[len];
+    for (int i = 1; i < len; i++)
+        codepoint = (codepoint << 6) | (str[i] & 0x3f);
+
+    return utf8_codepoint_width(codepoint);
 }
 
 int utf8_mbclen(char start_chr)
@@ -75,15 +493,48 @@ int utf8_mbclen(char start_chr)
         return 1; // failsafe
 }
 
+size_t utf8_char_size(const char *str, size_t n)
+{
+    size_t i = 1;
+
+    if (str[0] & 0x80)
+        while ((i < n) && ((str[i] & 0xc0) == 0x80))
+            i++;
+
+    return (n < i) ? n : i;
+}
+
 
 int utf8_byte_offset(const char *str, int char_count)
 {
-    int i;
+    // Every character takes at least one byte, so whole blocks of that many
+    // bytes can be counted before looking at individual characters
+    size_t i = 0;
+    bool prev_ascii = true;
+
+    while (char_count >= 64)
+    {
+        size_t block = strnlen(&str[i], char_count);
+        if (!block)
+            break;
+
+        size_t chars, width;
+        implementations[implementation].measure(&str[i], block, prev_ascii, false, &chars, &width);
+
+        i += block;
+        char_count -= chars;
+        prev_ascii = !(str[i - 1] & 0x80);
+    }
+
+    // Whatever follows a character's first byte belongs to it
+    if (!prev_ascii)
+        while ((str[i] & 0xc0) == 0x80)
+            i++;
 
-    for (i = 0; str[i] && (char_count > 0); char_count--)
+    for (; str[i] && (char_count > 0); char_count--)
         if (str[i++] & 0x80)
             while ((str[i] & 0xc0) == 0x80)
                 i++;
 
-    return (char_count > 0) ? -1 : i;
+    return (char_count > 0) ? -1 : (int)i;
 }
@@ -0,0 +1,113 @@
+// Checks that the screen takes as many columns for a piece of text as
+// utf8_measure() says and as walking through it character by character (like
+// draw_line() does) gives, also if the text is not valid UTF-8
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/term.c"
+
+
+int tabstop_width = 8;
+
+
+static const char *const pieces[] = {
+    "a", " ", "~", "é", "ж", "日", "語", "\xcc\x81" /* combining acute */,
+    "\xf0\x9f\x98\x80", "\xef\xbc\xa1",
+    "\x80", "\xbf", "\xc3", "\xe6", "\xe6\x97", "\xf0\x9f", "\xf8", "\xff",
+    "\xc0\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80"
+};
+
+
+static int columns_drawn(const char *text, size_t len)
+{
+    term_clear();
+    term_write(text, len);
+    finish_pending_mbc();
+
+    return cursor_x;
+}
+
+
+static void print_text(const char *text, size_t len)
+{
+    printf("\"");
+    for (size_t i = 0; i < len; i++)
+        printf("\\x%02x", (uint8_t)text[i]);
+    printf("\"");
+}
+
+
+static bool check(const char *text, size_t len)
+{
+    int drawn = columns_drawn(text, len);
+
+    size_t walked_chars = 0, walked = 0;
+    for (size_t i = 0; i < len; i += utf8_char_size(&text[i], len - i), walked_chars++)
+        walked += utf8_width(&text[i], len - i);
+
+    if ((size_t)drawn != walked)
+    {
+        printf("FAIL: ");
+        print_text(text, len);
+        printf(" takes %i columns on the screen, but %zu character by character\n", drawn, walked);
+        return false;
+    }
+
+    for (int scalar = 0; scalar < 2; scalar++)
+    {
+        utf8_force_scalar(scalar);
+
+        size_t chars, width;
+        utf8_measure(text, len, &chars, &width);
+
+        if (((size_t)drawn != width) || (walked_chars != chars))
+        {
+            printf("FAIL (%s): ", utf8_implementation());
+            print_text(text, len);
+            printf(" takes %i columns (%zu characters) on the screen, but %zu (%zu) according to utf8_measure()\n",
+                   drawn, walked_chars, width, chars);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+int main(void)
+{
+    term_width = 1024;
+    term_height = 4;
+    allocate_screen();
+
+    bool ok = check("caf\xe9 x|", 7) && check("a\x80" "b", 3) && check("\xe3\x81x\x80\x80y", 6) &&
+              check("\xe6\x97\xa5", 2) && check("e\xcc\x81\x80", 4);
+
+    srand(1);
+    char text[512];
+
+    for (int round = 0; ok && (round < 100000); round++)
+    {
+        size_t len = 0;
+
+        // Nothing behind the text may be looked at
+        memset(text, 0x80, sizeof(text));
+
+        for (int count = rand() % 64; count > 0; count--)
+        {
+            const char *piece = pieces[rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+            size_t piece_len = strlen(piece);
+
+            memcpy(&text[len], piece, piece_len);
+            len += piece_len;
+        }
+
+        ok = check(text, len);
+    }
+
+    if (ok)
+        printf("OK\n");
+
+    return !ok;
+}
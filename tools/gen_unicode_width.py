@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Generates the two-level display width table used by src/utf8.c.
+
+Usage: gen_unicode_width.py UNICODE_VERSION [UNICODE_DATA_DIR]
+
+Reads EastAsianWidth.txt and UnicodeData.txt from the given directory, or uses
+the Unicode database built into Python if no directory is given.  Either has to
+be of the given Unicode version, so that the table does not depend on whatever
+the host happens to have installed.
+
+Widths are:
+  0  for nonspacing and enclosing marks and format characters (except for the
+     soft hyphen), and for Hangul medial vowels and final consonants, which
+     are combined with the preceding syllable
+  2  for East Asian Wide and Fullwidth characters (including unassigned code
+     points in the ranges that default to Wide)
+  1  for everything else
+"""
+
+import os
+import sys
+
+MAX_CODEPOINT = 0x10ffff
+BLOCK_BITS = 8
+BLOCK_SIZE = 1 << BLOCK_BITS
+
+# Unassigned code points in these ranges are Wide by default (see the header
+# of EastAsianWidth.txt)
+DEFAULT_WIDE = [
+    (0x3400, 0x4dbf),
+    (0x4e00, 0x9fff),
+    (0xf900, 0xfaff),
+    (0x20000, 0x2fffd),
+    (0x30000, 0x3fffd),
+]
+
+ZERO_WIDTH = [
+    (0x1160, 0x11ff),
+    (0xd7b0, 0xd7ff),
+    (0x200b, 0x200b),
+]
+
+
+def strip(line):
+    return line.split('#', 1)[0].strip()
+
+
+def load_files(directory, version):
+    eaw = {}
+    with open(os.path.join(directory, 'EastAsianWidth.txt'), encoding='utf-8') as f:
+        # The first line names the file with its version
+        # ("# EastAsianWidth-15.1.0.txt")
+        found = f.readline().strip().lstrip('# ')
+        if found != 'EastAsianWidth-%s.txt' % version:
+            sys.exit('%s: %s is not from Unicode %s' % (sys.argv[0], found or 'EastAsianWidth.txt', version))
+
+        for line in f:
+            line = strip(line)
+            if not line:
+                continue
+            cps, prop = (s.strip() for s in line.split(';'))
+            first, _, last = cps.partition('..')
+            for cp in range(int(first, 16), int(last or first, 16) + 1):
+                eaw[cp] = prop
+
+    gc = {}
+    range_start = None
+    with open(os.path.join(directory, 'UnicodeData.txt'), encoding='utf-8') as f:
+        for line in f:
+            fields = line.split(';')
+            if len(fields) < 3:
+                continue
+            cp, name, cat = int(fields[0], 16), fields[1], fields[2]
+            if name.endswith(', First>'):
+                range_start = cp
+                continue
+            if name.endswith(', Last>'):
+                for c in range(range_start, cp + 1):
+                    gc[c] = cat
+                continue
+            gc[cp] = cat
+
+    return (lambda cp: eaw.get(cp, 'N')), (lambda cp: gc.get(cp, 'Cn')), 'Unicode %s data files' % version
+
+
+def load_builtin(version):
+    import unicodedata
+    if unicodedata.unidata_version != version:
+        sys.exit('%s: Python has Unicode %s, not %s; give the directory with the data files'
+                 % (sys.argv[0], unicodedata.unidata_version, version))
+
+    return (lambda cp: unicodedata.east_asian_width(chr(cp))), \
+           (lambda cp: unicodedata.category(chr(cp))), \
+           'Python unicodedata %s' % unicodedata.unidata_version
+
+
+def width(cp, eaw, gc):
+    cat = gc(cp)
+
+    if any(first <= cp <= last for first, last in ZERO_WIDTH):
+        return 0
+    if cat in ('Mn', 'Me') or (cat == 'Cf' and cp != 0xad):
+        return 0
+
+    if eaw(cp) in ('W', 'F'):
+        return 2
+    if cat == 'Cn' and any(first <= cp <= last for first, last in DEFAULT_WIDE):
+        return 2
+
+    return 1
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit('Usage: %s UNICODE_VERSION [UNICODE_DATA_DIR]' % sys.argv[0])
+
+    version = sys.argv[1]
+    if len(sys.argv) == 3:
+        try:
+            eaw, gc, source = load_files(sys.argv[2], version)
+        except OSError as e:
+            sys.exit('%s: %s' % (sys.argv[0], e))
+    else:
+        eaw, gc, source = load_builtin(version)
+
+    widths = [width(cp, eaw, gc) for cp in range(MAX_CODEPOINT + 1)]
+
+    # src/utf8.c only looks up characters starting from U+0300
+    assert all(w == 1 for w in widths[0x20:0x300])
+
+    blocks, index = [], []
+    block_ids = {}
+    for start in range(0, MAX_CODEPOINT + 1, BLOCK_SIZE):
+        packed = bytearray(BLOCK_SIZE // 4)
+        for i, w in enumerate(widths[start:start + BLOCK_SIZE]):
+            packed[i // 4] |= w << ((i % 4) * 2)
+        packed = bytes(packed)
+        if packed not in block_ids:
+            block_ids[packed] = len(blocks)
+            blocks.append(packed)
+        index.append(block_ids[packed])
+
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write('// Generated by tools/gen_unicode_width.py from %s; do not edit\n\n' % source)
+    out.write('#define UNICODE_WIDTH_BLOCK_BITS %i\n\n' % BLOCK_BITS)
+    out.write('static const uint8_t unicode_width_index[%i] = {\n' % len(index))
+    for i in range(0, len(index), 16):
+        out.write('    %s,\n' % ', '.join('%i' % v for v in index[i:i + 16]))
+    out.write('};\n\n')
+    out.write('// Two bits per character\n')
+    out.write('static const uint8_t unicode_width_blocks[%i][%i] __attribute__((aligned(64))) = {\n'
+              % (len(blocks), BLOCK_SIZE // 4))
+    for block in blocks:
+        out.write('    {\n')
+        for i in range(0, len(block), 16):
+            out.write('        %s,\n' % ', '.join('0x%02x' % v for v in block[i:i + 16]))
+        out.write('    },\n')
+    out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()